@@ -0,0 +1,96 @@
+#ifndef EXTERNAL_SORT_ARENASTRINGHANDLE_HPP
+#define EXTERNAL_SORT_ARENASTRINGHANDLE_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "key_prefix.hpp"
+#include "mapped_file.hpp"
+#include "string_arena.hpp"
+
+namespace ExternalSort {
+
+/*
+ * Run value of the string connectors. It only points to a line stored in the
+ * StringArena of the run, so the run is released with the arena. The first 8
+ * bytes of the line are cached as a key prefix, which decides most
+ * comparisons without dereferencing the line.
+ */
+class ArenaStringHandle {
+  unsigned long prefix;
+  const char *bytes;
+  unsigned long length;
+
+public:
+  using Storage = StringArena;
+
+  static constexpr bool fixed_size = false;
+  // runs can be front coded, the value is its line
+  static constexpr bool line_only = true;
+
+  ArenaStringHandle() : prefix(0), bytes(nullptr), length(0) {}
+
+  ArenaStringHandle(const char *bytes, unsigned long length)
+      : prefix(string_key_prefix(bytes, length)), bytes(bytes),
+        length(length) {}
+
+  size_t size() const { return length; }
+
+  const char *data() const { return bytes; }
+
+  // the bytes belong to the StringArena
+  unsigned long memory_usage() const { return 0; }
+
+  struct Comparator {
+    bool operator()(const ArenaStringHandle &lhs,
+                    const ArenaStringHandle &rhs) {
+      return lhs < rhs;
+    }
+  };
+
+  bool operator<(const ArenaStringHandle &other) const {
+    return compare_prefixed(prefix, bytes, length, other.prefix, other.bytes,
+                            other.length) < 0;
+  }
+
+  bool operator==(const ArenaStringHandle &other) const {
+    return prefix == other.prefix && length == other.length &&
+           (length <= sizeof(unsigned long) ||
+            std::memcmp(bytes, other.bytes, length) == 0);
+  }
+
+  bool operator!=(const ArenaStringHandle &other) const {
+    return !(*this == other);
+  }
+
+  static bool read_value(std::ifstream &ifs, ArenaStringHandle &next_val,
+                         StringArena &arena) {
+    if (!arena.read_line(ifs, next_val.bytes, next_val.length))
+      return false;
+    next_val.prefix = string_key_prefix(next_val.bytes, next_val.length);
+    return true;
+  }
+
+  // Copies the line straight from the mapping into the arena
+  static bool read_mapped(MappedInput &input, ArenaStringHandle &next_val,
+                          StringArena &arena) {
+    const char *line;
+    if (!input.take_line(line, next_val.length))
+      return false;
+    next_val.bytes = arena.append(line, next_val.length);
+    next_val.prefix = string_key_prefix(next_val.bytes, next_val.length);
+    return true;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const ArenaStringHandle &data) {
+    os.write(data.bytes, static_cast<std::streamsize>(data.length));
+    os.put('\n');
+    return os;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif // EXTERNAL_SORT_ARENASTRINGHANDLE_HPP
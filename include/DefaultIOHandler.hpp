@@ -10,14 +10,18 @@
 namespace ExternalSort {
 class DefaultIOHandler {
 public:
+  // values are framed by the connector alone
+  static constexpr bool raw_records = true;
+
   class Reader {
     std::ifstream &is;
 
   public:
     explicit Reader(std::ifstream &is) : is(is) {}
 
-    template <typename T> bool read_value(T &out) {
-      return T::read_value(is, out);
+    template <typename T, typename... Storage>
+    bool read_value(T &out, Storage &...storage) {
+      return T::read_value(is, out, storage...);
     }
   };
 
@@ -9,7 +9,9 @@
 #include <fstream>
 #include <string>
 
+#include "ArenaStringHandle.hpp"
 #include "light_string.hpp"
+#include "mapped_file.hpp"
 namespace ExternalSort {
 
 struct LightStringSortConnector {
@@ -17,10 +19,18 @@ struct LightStringSortConnector {
 
 public:
   static constexpr bool fixed_size = false;
+  // runs can be front coded, the value is its line
+  static constexpr bool line_only = true;
+
+  // runs are generated over lines stored in a StringArena
+  using RunValue = ArenaStringHandle;
 
   explicit LightStringSortConnector(light_string &&input_string)
       : input_string(std::move(input_string)) {}
 
+  LightStringSortConnector(const char *line, unsigned long length)
+      : input_string(line, length) {}
+
   LightStringSortConnector() = default;
 
   LightStringSortConnector(LightStringSortConnector &&other) noexcept
@@ -39,6 +49,10 @@ public:
 
   size_t size() const { return input_string.size(); }
 
+  const char *data() const { return input_string.data(); }
+
+  unsigned long memory_usage() const { return input_string.memory_usage(); }
+
   struct Comparator {
     bool operator()(const LightStringSortConnector &lhs,
                     const LightStringSortConnector &rhs) {
@@ -74,6 +88,16 @@ public:
     }
     return was_read;
   }
+
+  static bool read_mapped(MappedInput &input,
+                          LightStringSortConnector &next_val) {
+    const char *line;
+    unsigned long length;
+    if (!input.take_line(line, length))
+      return false;
+    next_val = LightStringSortConnector(light_string(line, length));
+    return true;
+  }
 };
 
 std::ostream &operator<<(std::ostream &os,
@@ -0,0 +1,89 @@
+#ifndef EXTERNAL_SORT_MMAPIOHANDLER_HPP
+#define EXTERNAL_SORT_MMAPIOHANDLER_HPP
+
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "DefaultIOHandler.hpp"
+#include "file_descriptor.hpp"
+#include "mapped_file.hpp"
+
+namespace ExternalSort {
+
+// Whether T parses its values from a MappedInput with T::read_mapped
+template <typename T, typename Storage, typename = void>
+struct reads_mapped : std::false_type {};
+
+template <typename T, typename... Storage>
+struct reads_mapped<
+    T, std::tuple<Storage...>,
+    std::void_t<decltype(T::read_mapped(std::declval<MappedInput &>(),
+                                        std::declval<T &>(),
+                                        std::declval<Storage &>()...))>>
+    : std::true_type {};
+
+// Whether Reader knows how many values its file holds, given by values()
+template <typename Reader, typename = void>
+struct counts_values : std::false_type {};
+
+template <typename Reader>
+struct counts_values<
+    Reader, std::void_t<decltype(std::declval<const Reader &>().values())>>
+    : std::true_type {};
+
+/*
+ * IOHandler that reads the input and the runs through a memory mapped
+ * window of WindowBytes, for connectors that define read_mapped. Those parse
+ * their values in place, without a streambuf call per value. Other
+ * connectors, and streams with no file descriptor, are read by Base, which
+ * also reads the header of the file and writes every file. When the header
+ * of Base counts the values, the mapped reads stop after that many.
+ */
+template <unsigned long WindowBytes = 64UL << 20,
+          typename Base = DefaultIOHandler>
+class MmapIOHandler : public Base {
+public:
+  // values may be parsed by read_mapped, so files are never cut in ranges
+  static constexpr bool raw_records = false;
+
+  class Reader {
+    // reads the header, so the mapping starts after it
+    typename Base::Reader base;
+    std::unique_ptr<MappedInput> input;
+    // values left to read from the mapping
+    unsigned long remaining;
+
+  public:
+    explicit Reader(std::ifstream &is)
+        : base(is), remaining(std::numeric_limits<unsigned long>::max()) {
+      if constexpr (counts_values<typename Base::Reader>::value)
+        remaining = base.values();
+      int fd = filebuf_fd(*is.rdbuf());
+      auto position = static_cast<long>(is.tellg());
+      if (fd >= 0 && position >= 0)
+        input = std::make_unique<MappedInput>(
+            fd, static_cast<unsigned long>(position), WindowBytes);
+    }
+
+    template <typename T, typename... Storage>
+    bool read_value(T &out, Storage &...storage) {
+      if constexpr (reads_mapped<T, std::tuple<Storage...>>::value) {
+        if (input) {
+          if (remaining == 0 || !T::read_mapped(*input, out, storage...))
+            return false;
+          remaining--;
+          return true;
+        }
+      }
+      return base.read_value(out, storage...);
+    }
+  };
+};
+
+} // namespace ExternalSort
+
+#endif // EXTERNAL_SORT_MMAPIOHANDLER_HPP
@@ -0,0 +1,116 @@
+#ifndef EXTERNAL_SORT_PREFIXSTRINGSORTCONNECTOR_HPP
+#define EXTERNAL_SORT_PREFIXSTRINGSORTCONNECTOR_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+#include "ArenaStringHandle.hpp"
+#include "key_prefix.hpp"
+#include "light_string.hpp"
+#include "mapped_file.hpp"
+
+namespace ExternalSort {
+
+/*
+ * Line connector that keeps the first 8 bytes of the line as a big-endian
+ * integer next to the string and its length. Most comparisons are decided on
+ * the prefix without touching the string bytes.
+ */
+class PrefixStringSortConnector {
+  unsigned long prefix;
+  light_string input_string;
+
+public:
+  static constexpr bool fixed_size = false;
+  // runs can be front coded, the value is its line
+  static constexpr bool line_only = true;
+
+  // runs are generated over lines stored in a StringArena
+  using RunValue = ArenaStringHandle;
+
+  explicit PrefixStringSortConnector(const std::string &line)
+      : prefix(string_key_prefix(line.data(), line.size())),
+        input_string(line) {}
+
+  PrefixStringSortConnector(const char *line, unsigned long length)
+      : prefix(string_key_prefix(line, length)), input_string(line, length) {}
+
+  PrefixStringSortConnector() : prefix(0) {}
+
+  PrefixStringSortConnector(PrefixStringSortConnector &&other) noexcept
+      : prefix(other.prefix), input_string(std::move(other.input_string)) {}
+
+  PrefixStringSortConnector(const PrefixStringSortConnector &other) = default;
+
+  PrefixStringSortConnector &
+  operator=(PrefixStringSortConnector &&other) noexcept {
+    prefix = other.prefix;
+    input_string = std::move(other.input_string);
+    return *this;
+  }
+
+  PrefixStringSortConnector &
+  operator=(const PrefixStringSortConnector &other) = default;
+
+  size_t size() const { return input_string.size(); }
+
+  const char *data() const { return input_string.data(); }
+
+  unsigned long memory_usage() const { return input_string.memory_usage(); }
+
+  int compare(const PrefixStringSortConnector &other) const {
+    return compare_prefixed(prefix, input_string.data(), input_string.size(),
+                            other.prefix, other.input_string.data(),
+                            other.input_string.size());
+  }
+
+  struct Comparator {
+    bool operator()(const PrefixStringSortConnector &lhs,
+                    const PrefixStringSortConnector &rhs) {
+      return lhs.compare(rhs) < 0;
+    }
+  };
+
+  bool operator==(const PrefixStringSortConnector &other) const {
+    return compare(other) == 0;
+  }
+
+  bool operator!=(const PrefixStringSortConnector &other) const {
+    return compare(other) != 0;
+  }
+
+  bool operator<(const PrefixStringSortConnector &other) const {
+    return compare(other) < 0;
+  }
+
+  static bool read_value(std::ifstream &ifs,
+                         PrefixStringSortConnector &next_val) {
+    std::string line;
+    auto was_read = (bool)std::getline(ifs, line);
+    if (was_read) {
+      next_val = PrefixStringSortConnector(line);
+    }
+    return was_read;
+  }
+
+  static bool read_mapped(MappedInput &input,
+                          PrefixStringSortConnector &next_val) {
+    const char *line;
+    unsigned long length;
+    if (!input.take_line(line, length))
+      return false;
+    next_val = PrefixStringSortConnector(line, length);
+    return true;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const PrefixStringSortConnector &data) {
+    os << data.input_string << "\n";
+    return os;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif // EXTERNAL_SORT_PREFIXSTRINGSORTCONNECTOR_HPP
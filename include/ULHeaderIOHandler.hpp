@@ -11,6 +11,10 @@ namespace ExternalSort {
 
 class ULHeaderIOHandler {
 public:
+  static constexpr unsigned long header_size = sizeof(unsigned long);
+  // after the count, values are framed by the connector alone
+  static constexpr bool raw_records = true;
+
   class Reader {
     std::ifstream &is;
     unsigned long counter;
@@ -22,8 +26,12 @@ public:
       is.read(reinterpret_cast<char *>(&sz), sizeof(unsigned long));
     }
 
-    template <typename T> bool read_value(T &out) {
-      T::read_value(is, out);
+    // Values counted by the header, bytes after them are not read
+    unsigned long values() const { return sz; }
+
+    template <typename T, typename... Storage>
+    bool read_value(T &out, Storage &...storage) {
+      T::read_value(is, out, storage...);
       counter++;
       return counter <= sz;
     }
@@ -7,6 +7,9 @@
 
 #include <fstream>
 #include <cstddef>
+#include <cstring>
+
+#include "mapped_file.hpp"
 
 namespace ExternalSort {
 
@@ -15,6 +18,8 @@ class UnsignedLongSortConnectorWHeader {
 
 public:
   static constexpr bool fixed_size = true;
+  // runs can be packed, the value is its radix key
+  static constexpr bool key_only = true;
 
   explicit UnsignedLongSortConnectorWHeader(unsigned long value)
       : value(value) {}
@@ -65,7 +70,18 @@ public:
     return true;
   }
 
+  static bool read_mapped(MappedInput &input,
+                          UnsignedLongSortConnectorWHeader &next_val) {
+    auto *bytes = input.take(sizeof(unsigned long));
+    if (!bytes)
+      return false;
+    std::memcpy(&next_val.value, bytes, sizeof(unsigned long));
+    return true;
+  }
+
   static size_t size() { return sizeof(unsigned long); }
+
+  unsigned long radix_key() const { return value; }
 };
 
 std::ostream &operator<<(std::ostream &os,
@@ -0,0 +1,63 @@
+#ifndef EXTERNAL_SORT_URINGIOHANDLER_HPP
+#define EXTERNAL_SORT_URINGIOHANDLER_HPP
+
+#include <fstream>
+#include <memory>
+
+#include "DefaultIOHandler.hpp"
+#include "io_buffer.hpp"
+#include "uring_queue.hpp"
+#include "uring_streambuf.hpp"
+
+namespace ExternalSort {
+
+/*
+ * IOHandler whose run and merge files are read and written through io_uring.
+ * Values are parsed and formatted by Base, only the stream buffers change:
+ * the buffer the sort gives to every file is cut into Window chunks kept in
+ * flight ahead of the reader or behind the writer. The files attached on a
+ * thread share one submission queue of QueueDepth entries, so the reads of
+ * all the runs of a merge and the writes of its output go to the kernel in
+ * the same batches. Without io_uring the same chunks use pread and pwrite.
+ * With Direct the files are read and written with O_DIRECT where the file
+ * system allows it, so runs read once don't evict the page cache of others.
+ */
+template <unsigned QueueDepth = 64, unsigned Window = 4,
+          typename Base = DefaultIOHandler, bool Direct = false>
+class UringIOHandler : public Base {
+  static UringQueue &queue() {
+    thread_local UringQueue thread_queue(QueueDepth);
+    return thread_queue;
+  }
+
+public:
+  static void attach_input(std::ifstream &ifs, io_buffer &buffer) {
+    int fd = filebuf_fd(*ifs.rdbuf());
+    if (fd < 0 || buffer.size() < Window) {
+      ifs.rdbuf()->pubsetbuf(buffer.data(),
+                             static_cast<std::streamsize>(buffer.size()));
+      return;
+    }
+    attach_stream_buffer(ifs, std::make_unique<UringReadBuf>(
+                                  queue(), fd, buffer.data(), buffer.size(),
+                                  Window, Direct));
+    // a failed read stops the sort instead of ending the file early
+    ifs.exceptions(std::ios::badbit);
+  }
+
+  static void attach_output(std::ofstream &ofs, io_buffer &buffer) {
+    int fd = filebuf_fd(*ofs.rdbuf());
+    if (fd < 0 || buffer.size() < Window) {
+      ofs.rdbuf()->pubsetbuf(buffer.data(),
+                             static_cast<std::streamsize>(buffer.size()));
+      return;
+    }
+    attach_stream_buffer(ofs, std::make_unique<UringWriteBuf>(
+                                  queue(), fd, buffer.data(), buffer.size(),
+                                  Window, Direct));
+  }
+};
+
+} // namespace ExternalSort
+
+#endif // EXTERNAL_SORT_URINGIOHANDLER_HPP
@@ -13,10 +13,11 @@ namespace ExternalSort {
 
 inline std::string generate_uuid_v4() {
 
-  static std::random_device rd;
-  static std::mt19937 gen(rd());
-  static std::uniform_int_distribution<> dis(0, 15);
-  static std::uniform_int_distribution<> dis2(8, 11);
+  // one generator per thread, merges create files concurrently
+  thread_local std::random_device rd;
+  thread_local std::mt19937 gen(rd());
+  thread_local std::uniform_int_distribution<> dis(0, 15);
+  thread_local std::uniform_int_distribution<> dis2(8, 11);
 
   std::stringstream ss;
   int i;
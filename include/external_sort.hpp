@@ -2,31 +2,231 @@
 #define _EXTERNAL_SORT_HPP_
 
 #include <algorithm>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
-#include <list>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <regex>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
-#include <unordered_set>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "file_descriptor.hpp"
+#include "front_coded_run.hpp"
 #include "introsort.hpp"
+#include "io_buffer.hpp"
+#include "loser_tree.hpp"
+#include "memory_budget.hpp"
+#include "multiway_merge.hpp"
+#include "packed_run.hpp"
+#include "radix_sort.hpp"
+#include "sample_sort.hpp"
+#include "temp_dirs.hpp"
 
 #include "DefaultIOHandler.hpp"
 #include "ParallelWorker.hpp"
 #include "UuidGenerator.hpp"
 #include "time_control.hpp"
+#include "write_behind.hpp"
 
 namespace ExternalSort {
 
 namespace fs = std::filesystem;
 
+// Bytes before the first record of a file, given by IOHandler::header_size
+template <typename IOHandler, typename = void>
+struct io_header_size : std::integral_constant<unsigned long, 0> {};
+
+template <typename IOHandler>
+struct io_header_size<IOHandler, std::void_t<decltype(IOHandler::header_size)>>
+    : std::integral_constant<unsigned long, IOHandler::header_size> {};
+
+// Whether the records of IOHandler files are read by T::read_value and
+// written by operator<< right after the header, so a file can be read or
+// written from any record on. Handlers opt in with IOHandler::raw_records,
+// the others never get their files cut in ranges.
+template <typename IOHandler, typename = void>
+struct io_raw_records : std::false_type {};
+
+template <typename IOHandler>
+struct io_raw_records<IOHandler,
+                      std::void_t<decltype(IOHandler::raw_records)>>
+    : std::bool_constant<IOHandler::raw_records> {};
+
+// Sets up the buffers of run and merge files, through IOHandler::attach_input
+// and attach_output when it defines them. Otherwise outputs with large
+// buffers are written behind by a thread of their own, and the rest use
+// pubsetbuf.
+template <typename IOHandler, typename = void> struct io_streams {
+  static void attach_input(std::ifstream &ifs, io_buffer &buffer) {
+    ifs.rdbuf()->pubsetbuf(buffer.data(),
+                           static_cast<std::streamsize>(buffer.size()));
+  }
+
+  static void attach_output(std::ofstream &ofs, io_buffer &buffer) {
+    if (attach_write_behind(ofs, buffer))
+      return;
+    ofs.rdbuf()->pubsetbuf(buffer.data(),
+                           static_cast<std::streamsize>(buffer.size()));
+  }
+};
+
+template <typename IOHandler>
+struct io_streams<IOHandler, std::void_t<decltype(&IOHandler::attach_input)>> {
+  static void attach_input(std::ifstream &ifs, io_buffer &buffer) {
+    IOHandler::attach_input(ifs, buffer);
+  }
+
+  static void attach_output(std::ofstream &ofs, io_buffer &buffer) {
+    IOHandler::attach_output(ofs, buffer);
+  }
+};
+
+// Value type used while generating runs, T::RunValue when it is defined
+template <typename T, typename = void> struct run_value_of {
+  using type = T;
+};
+
+template <typename T>
+struct run_value_of<T, std::void_t<typename T::RunValue>> {
+  using type = typename T::RunValue;
+};
+
+struct NoRunStorage {
+  explicit NoRunStorage(unsigned long /* chunk_size */ = 0) {}
+  void clear() {}
+  unsigned long memory_usage() const { return 0; }
+  unsigned long growth_step() const { return 0; }
+};
+
+// Storage the values of a run point into, V::Storage when it is defined
+template <typename V, typename = void> struct run_storage_of {
+  using type = NoRunStorage;
+};
+
+template <typename V>
+struct run_storage_of<V, std::void_t<typename V::Storage>> {
+  using type = typename V::Storage;
+};
+
+// Heap bytes owned by a value, V::memory_usage() when it is defined. Other
+// variable size values are assumed to own size() + 1 bytes.
+template <typename V, typename = void> struct value_memory {
+  static unsigned long of(const V &value) {
+    if constexpr (V::fixed_size) {
+      return 0;
+    } else {
+      return value.size() + 1;
+    }
+  }
+};
+
+template <typename V>
+struct value_memory<
+    V, std::void_t<decltype(std::declval<const V &>().memory_usage())>> {
+  static unsigned long of(const V &value) { return value.memory_usage(); }
+};
+
 enum DATA_MODE { BINARY = 0, TEXT = 1 };
+
+/*
+ * LOAD_SORT_SPILL reads a run until the memory budget is full, then sorts
+ * and writes it before reading again.
+ * DOUBLE_BUFFERED splits the budget in two halves and keeps reading the next
+ * run on a separate thread while the current one is sorted and written.
+ * REPLACEMENT_SELECTION streams the input through a heap that fills the
+ * budget, producing runs of about twice the budget on random input and a
+ * single run on nearly sorted input.
+ * PARALLEL_RANGES splits the input in one byte range per worker, aligned to
+ * record boundaries, and each worker parses, sorts and writes its own runs.
+ * It needs an IOHandler with raw_records, others load, sort and spill.
+ */
+enum RUN_GENERATION {
+  LOAD_SORT_SPILL = 0,
+  DOUBLE_BUFFERED = 1,
+  REPLACEMENT_SELECTION = 2,
+  PARALLEL_RANGES = 3
+};
+
+/*
+ * Engine used to sort a run in memory when the connector has no radix key.
+ * SEGMENT_MERGE sorts fixed size segments in parallel and merges them.
+ * SAMPLE_SORT partitions the run in place by sampled splitters into buckets
+ * that are sorted independently, so no merge step is needed.
+ */
+enum SORT_ENGINE { SEGMENT_MERGE = 0, SAMPLE_SORT = 1 };
+
+/*
+ * FIXED_FAN_IN merges max_files runs at once with blocks of block_size bytes.
+ * BUDGET_FAN_IN derives both from the memory left for merging and the sizes
+ * of the runs, taking the fan-in, up to max_files, and the block size, at
+ * least block_size, that minimize the bytes rewritten plus a seek penalty
+ * per block. Either way the smallest runs are merged first.
+ */
+enum MERGE_SIZING { FIXED_FAN_IN = 0, BUDGET_FAN_IN = 1 };
+
+/*
+ * Format of the temporary runs. PACKED_RUNS stores the runs of connectors
+ * that are only an integer key (packs_runs) as bit-packed gaps between
+ * sorted keys, FRONT_CODED_RUNS stores the runs of connectors that are only
+ * a line (front_codes_runs) without the prefix each line shares with the one
+ * before. Other connectors and the output keep the IOHandler format.
+ */
+enum RUN_FORMAT { RAW_RUNS = 0, PACKED_RUNS = 1, FRONT_CODED_RUNS = 2 };
+
+/*
+ * MERGE_DISJOINT merges every run. CONCATENATE_DISJOINT keeps the first and
+ * last value of each run, and runs whose ranges follow each other are
+ * appended into one file with copy_file_range instead of being merged, so
+ * only the overlapping runs of near sorted inputs are merged. Raw runs are
+ * only appended with an IOHandler with raw_records, others merge them.
+ */
+enum DISJOINT_RUNS { MERGE_DISJOINT = 0, CONCATENATE_DISJOINT = 1 };
+
+struct SortOptions {
+  RUN_GENERATION run_generation = LOAD_SORT_SPILL;
+  SORT_ENGINE sort_engine = SEGMENT_MERGE;
+  MERGE_SIZING merge_sizing = FIXED_FAN_IN;
+  RUN_FORMAT run_format = RAW_RUNS;
+  DISJOINT_RUNS disjoint_runs = MERGE_DISJOINT;
+};
+
+/*
+ * What a sort used. memory_peak is the high-water mark of the bytes reserved
+ * from the memory budget by buffers, runs and merge blocks, peak_rss is the
+ * maximum resident set size of the whole process. The merge plan is given by
+ * the files merged at once, the block size per file, the number of merges
+ * and the bytes they are expected to write. concatenated_runs is the number
+ * of runs appended to a disjoint one instead of being merged.
+ */
+struct SortReport {
+  unsigned long memory_budget = 0;
+  unsigned long memory_peak = 0;
+  unsigned long peak_rss = 0;
+  unsigned long runs = 0;
+  unsigned long merge_fan_in = 0;
+  unsigned long merge_block_size = 0;
+  unsigned long merges = 0;
+  unsigned long merge_bytes = 0;
+  unsigned long concatenated_runs = 0;
+};
+
 template <typename T, DATA_MODE DM = TEXT, typename TC = NoTimeControl,
           typename IOHandler = DefaultIOHandler>
 class ExternalSort {
@@ -34,109 +234,632 @@ class ExternalSort {
 
   using comp_t = typename T::Comparator;
 
-  struct PairComp {
+  using run_value_t = typename run_value_of<T>::type;
+  using run_storage_t = typename run_storage_of<run_value_t>::type;
+  static constexpr bool with_run_storage =
+      !std::is_same_v<run_storage_t, NoRunStorage>;
+
+  static constexpr unsigned long max_storage_chunk = 1UL << 20;
+
+  // Bytes that could be transferred in the time of a seek, charged per block
+  // by the merge planner
+  static constexpr unsigned long seek_cost_bytes = 1UL << 20;
+  static constexpr unsigned long max_merge_block = 8UL << 20;
+  static constexpr unsigned long merge_block_alignment = 4096;
+
+  /*
+   * Values of a run being generated and the storage they point into. The
+   * reservation covers the largest size the run reached, its capacity and
+   * storage chunks are kept for the next run.
+   */
+  struct RunBuffer {
+    std::vector<run_value_t> values;
+    run_storage_t storage;
+    // heap bytes owned by the values
+    unsigned long values_memory = 0;
+    MemoryReservation reservation;
+
+    // storage grows in steps small enough for runs of memory_bound bytes
+    explicit RunBuffer(unsigned long memory_bound)
+        : storage(std::clamp(memory_bound / 16, 4096UL, max_storage_chunk)) {}
+
+    void clear() {
+      values.clear();
+      storage.clear();
+      values_memory = 0;
+    }
+  };
+
+  // Reads the records of one byte range of the input, the stream must be
+  // positioned at the start of the range
+  class RangeReader {
+    std::ifstream &is;
+    unsigned long remaining;
+
+  public:
+    RangeReader(std::ifstream &is, unsigned long length)
+        : is(is), remaining(length) {}
+
+    template <typename V, typename... Storage>
+    bool read_value(V &out, Storage &...storage) {
+      if (remaining == 0 || !V::read_value(is, out, storage...))
+        return false;
+      unsigned long consumed;
+      if constexpr (DM == TEXT) {
+        consumed = out.size() + 1;
+      } else {
+        consumed = V::size();
+      }
+      remaining -= std::min(remaining, consumed);
+      return true;
+    }
+  };
+
+  // Heap order for replacement selection, the int is the run a value belongs
+  // to and lower runs are popped first
+  struct RunPairComp {
     comp_t &comparator;
-    explicit PairComp(comp_t &comparator) : comparator(comparator) {}
+    explicit RunPairComp(comp_t &comparator) : comparator(comparator) {}
     bool operator()(const pair_T_int &lhs, const pair_T_int &rhs) {
-      return !(comparator(lhs.first, rhs.first));
+      if (lhs.second != rhs.second)
+        return lhs.second > rhs.second;
+      return comparator(rhs.first, lhs.first);
     }
   };
 
 public:
-  static void sort(const std::string &input_filename,
-                   const std::string &output_filename,
-                   const std::string &tmp_dir, int workers, int max_files,
-                   unsigned long memory_budget, unsigned long block_size,
-                   bool remove_duplicates) {
+  // Receives the sorted values in order, as the final merge produces them
+  using consumer_t = std::function<void(const T &)>;
+
+  static SortReport sort(const std::string &input_filename,
+                         const std::string &output_filename,
+                         const TempDirs &tmp_dirs, int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates) {
     comp_t comparator;
-    sort(input_filename, output_filename, tmp_dir, workers, max_files,
-         memory_budget, block_size, remove_duplicates, comparator);
+    return sort(input_filename, output_filename, tmp_dirs, workers, max_files,
+                memory_budget, block_size, remove_duplicates, comparator);
   }
 
-  static void sort(const std::string &input_filename,
-                   const std::string &output_filename,
-                   const std::string &tmp_dir, int workers, int max_files,
-                   unsigned long memory_budget, unsigned long block_size,
-                   bool remove_duplicates, comp_t &comparator) {
+  static SortReport sort(const std::string &input_filename,
+                         const std::string &output_filename,
+                         const TempDirs &tmp_dirs, int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates, comp_t &comparator) {
     TC tc;
-    sort(input_filename, output_filename, tmp_dir, workers, max_files,
-         memory_budget, block_size, remove_duplicates, comparator, tc);
+    return sort(input_filename, output_filename, tmp_dirs, workers, max_files,
+                memory_budget, block_size, remove_duplicates, comparator, tc);
   }
-  static void sort(const std::string &input_filename,
-                   const std::string &output_filename,
-                   const std::string &tmp_dir, int workers, int max_files,
-                   unsigned long memory_budget, unsigned long block_size,
-                   bool remove_duplicates, comp_t &comparator,
-                   TC &time_control) {
 
-    std::set<std::string> active_files;
+  static SortReport sort(const std::string &input_filename,
+                         const std::string &output_filename,
+                         const TempDirs &tmp_dirs, int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates, comp_t &comparator,
+                         TC &time_control) {
+    return sort(input_filename, output_filename, tmp_dirs, workers, max_files,
+                memory_budget, block_size, remove_duplicates, comparator,
+                time_control, SortOptions());
+  }
 
-    auto buffers = init_buffers(max_files, block_size);
+  static SortReport sort(const std::string &input_filename,
+                         const std::string &output_filename,
+                         const TempDirs &tmp_dirs, int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates, const SortOptions &options) {
+    comp_t comparator;
+    TC tc;
+    return sort(input_filename, output_filename, tmp_dirs, workers, max_files,
+                memory_budget, block_size, remove_duplicates, comparator, tc,
+                options);
+  }
 
-    auto current_filenames =
-        split_file(input_filename, tmp_dir, memory_budget, workers, buffers[0],
-                   buffers[max_files], remove_duplicates, comparator,
-                   time_control, active_files);
+  static SortReport sort(const std::string &input_filename,
+                         const std::string &output_filename,
+                         const TempDirs &tmp_dirs, int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates, comp_t &comparator,
+                         TC &time_control, const SortOptions &options) {
+    return sort_into(input_filename, MergeOutput{output_filename, nullptr},
+                     tmp_dirs, workers, max_files, memory_budget, block_size,
+                     remove_duplicates, comparator, time_control, options);
+  }
+
+  // Sorts into consumer instead of a file, the final merge calls it with
+  // every value in order
+  static SortReport sort(const std::string &input_filename,
+                         const consumer_t &consumer, const TempDirs &tmp_dirs,
+                         int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates, const SortOptions &options) {
+    comp_t comparator;
+    TC tc;
+    return sort(input_filename, consumer, tmp_dirs, workers, max_files,
+                memory_budget, block_size, remove_duplicates, comparator, tc,
+                options);
+  }
+
+  static SortReport sort(const std::string &input_filename,
+                         const consumer_t &consumer, const TempDirs &tmp_dirs,
+                         int workers, int max_files,
+                         unsigned long memory_budget, unsigned long block_size,
+                         bool remove_duplicates, comp_t &comparator,
+                         TC &time_control, const SortOptions &options) {
+    return sort_into(input_filename, MergeOutput{"", &consumer}, tmp_dirs,
+                     workers, max_files, memory_budget, block_size,
+                     remove_duplicates, comparator, time_control, options);
+  }
+
+private:
+  // Destination of a merge, the consumer when it is set, otherwise the file,
+  // written in the given run format
+  struct MergeOutput {
+    std::string filename;
+    const consumer_t *consumer;
+    RUN_FORMAT format = RAW_RUNS;
+  };
+
+  // A run file with its number of values and, when they could be kept, its
+  // first and last values
+  struct RunFile {
+    std::string filename;
+    unsigned long values = 0;
+    bool bounded = false;
+    T first{};
+    T last{};
+  };
+
+  // Copies a value of a run into bound, false when it can't be made a T
+  template <typename V> static bool copy_bound(const V &value, T &bound) {
+    if constexpr (std::is_same_v<V, T>) {
+      bound = value;
+      return true;
+    } else if constexpr (front_codes_runs<V>::value &&
+                         std::is_constructible_v<T, const char *,
+                                                 unsigned long>) {
+      bound = T(value.data(), value.size());
+      return true;
+    }
+    return false;
+  }
+
+  // Format the runs are written in, RAW_RUNS when the connector doesn't
+  // support the one requested
+  static RUN_FORMAT run_format(const SortOptions &options) {
+    if constexpr (DM == BINARY && packs_runs<T>::value)
+      if (options.run_format == PACKED_RUNS)
+        return PACKED_RUNS;
+    if constexpr (DM == TEXT && front_codes_runs<T>::value &&
+                  front_codes_runs<run_value_t>::value &&
+                  std::is_constructible_v<T, const char *, unsigned long>)
+      if (options.run_format == FRONT_CODED_RUNS)
+        return FRONT_CODED_RUNS;
+    return RAW_RUNS;
+  }
+
+  // Writer of a run file, in the IOHandler format or an encoded one
+  class RunWriter {
+    std::unique_ptr<typename IOHandler::Writer> writer;
+    std::unique_ptr<PackedRunWriter> packed;
+    std::unique_ptr<FrontCodedRunWriter> front_coded;
+
+  public:
+    RunWriter(std::ofstream &ofs, unsigned long elements, RUN_FORMAT format) {
+      if (format == PACKED_RUNS)
+        packed = std::make_unique<PackedRunWriter>(ofs);
+      else if (format == FRONT_CODED_RUNS)
+        front_coded = std::make_unique<FrontCodedRunWriter>(ofs);
+      else
+        writer = std::make_unique<typename IOHandler::Writer>(ofs, elements);
+    }
+
+    template <typename V> void write_value(const V &value) {
+      if constexpr (packs_runs<V>::value) {
+        if (packed) {
+          packed->write_key(value.radix_key());
+          return;
+        }
+      }
+      if constexpr (front_codes_runs<V>::value) {
+        if (front_coded) {
+          front_coded->write_line(value.data(), value.size());
+          return;
+        }
+      }
+      writer->write_value(value);
+    }
+
+    void fix_headers(unsigned long elements) {
+      if (packed)
+        packed->finish();
+      else if (writer)
+        writer->fix_headers(elements);
+    }
+  };
+
+  // Reader of a run file, in the IOHandler format or an encoded one
+  class RunReader {
+    std::unique_ptr<typename IOHandler::Reader> reader;
+    std::unique_ptr<PackedRunReader> packed;
+    std::unique_ptr<FrontCodedRunReader> front_coded;
+
+  public:
+    RunReader(std::ifstream &ifs, RUN_FORMAT format) {
+      if (format == PACKED_RUNS)
+        packed = std::make_unique<PackedRunReader>(ifs);
+      else if (format == FRONT_CODED_RUNS)
+        front_coded = std::make_unique<FrontCodedRunReader>(ifs);
+      else
+        reader = std::make_unique<typename IOHandler::Reader>(ifs);
+    }
+
+    bool read_value(T &out) {
+      if constexpr (packs_runs<T>::value) {
+        if (packed) {
+          std::uint64_t key;
+          if (!packed->read_key(key))
+            return false;
+          out = T(key);
+          return true;
+        }
+      }
+      if constexpr (std::is_constructible_v<T, const char *, unsigned long>) {
+        if (front_coded) {
+          const char *line;
+          unsigned long length;
+          if (!front_coded->read_line(line, length))
+            return false;
+          out = T(line, length);
+          return true;
+        }
+      }
+      return reader->read_value(out);
+    }
+  };
+
+  // Writer handing the merged values to a consumer
+  class ConsumerWriter {
+    const consumer_t &consumer;
+
+  public:
+    explicit ConsumerWriter(const consumer_t &consumer) : consumer(consumer) {}
+
+    void write_value(const T &value) { consumer(value); }
+  };
+
+  /*
+   * Sorts the input into the output. The final merge writes straight into
+   * the output file or consumer, only a single run is moved there instead.
+   */
+  static SortReport sort_into(const std::string &input_filename,
+                              const MergeOutput &output,
+                              const TempDirs &tmp_dirs, int workers,
+                              int max_files, unsigned long memory_budget,
+                              unsigned long block_size, bool remove_duplicates,
+                              comp_t &comparator, TC &time_control,
+                              const SortOptions &options) {
+
+    if (max_files < 2)
+      throw std::invalid_argument("at least two files must be merged at once");
+
+    std::set<std::string> active_files;
+
+    MemoryBudget budget(memory_budget);
+    SortReport report;
+    report.memory_budget = memory_budget;
+
+    auto io_memory = (max_files + 1) * block_size;
+    // the merge blocks are only needed once the runs are released
+    if (io_memory + merge_memory(max_files, block_size) > memory_budget)
+      throw std::runtime_error(
+          "memory budget of " + std::to_string(memory_budget) +
+          " bytes is too small for " + std::to_string(max_files) +
+          " merged files with blocks of " + std::to_string(block_size) +
+          " bytes");
+
+    MemoryReservation io_reservation(budget, io_memory, "I/O buffers");
+    TempPlacement placement(tmp_dirs);
+    std::vector<RunFile> run_files;
+    {
+      // until the merge the runs are written with all the buffers but one
+      io_buffer buffer_in(block_size);
+      io_buffer buffer_out(io_memory - block_size);
+      run_files = split_file(input_filename, placement, budget, workers,
+                             buffer_in, buffer_out, remove_duplicates,
+                             comparator, time_control, active_files, options);
+    }
+    report.runs = run_files.size();
+    std::vector<std::string> current_filenames;
+    // runs are appended byte for byte after their header
+    if (options.disjoint_runs == CONCATENATE_DISJOINT &&
+        (run_format(options) != RAW_RUNS || io_raw_records<IOHandler>::value)) {
+      current_filenames =
+          concatenate_disjoint_runs(run_files, remove_duplicates, comparator,
+                                    run_format(options), active_files, report);
+    } else {
+      for (auto &run_file : run_files)
+        current_filenames.push_back(run_file.filename);
+    }
+    for (auto &filename : current_filenames) {
+      std::error_code error;
+      auto size = fs::file_size(fs::path(filename), error);
+      placement.placed(filename, error ? 0 : static_cast<unsigned long>(size));
+    }
 
     if constexpr (TC::with_time_control)
       if (!time_control.tick()) {
         clean_up_files(active_files);
-        return;
+        return finish_report(report, budget);
       }
 
-    while (current_filenames.size() > 1) {
-      current_filenames = merge_bottom_up(
-          current_filenames, tmp_dir, max_files, block_size, buffers,
-          remove_duplicates, comparator, time_control, active_files);
-      if constexpr (TC::with_time_control)
-        if (!time_control.tick()) {
-          clean_up_files(active_files);
-          return;
+    if (current_filenames.empty()) {
+      clean_up_files(active_files);
+      return finish_report(report, budget);
+    }
+
+    auto plan =
+        plan_merges(current_filenames, workers, max_files, block_size,
+                    budget.available() + io_reservation.size(), options);
+    if (plan.merges.empty() &&
+        (output.consumer || run_format(options) != RAW_RUNS)) {
+      // a single run is streamed to the consumer, or decoded, by a merge of
+      // its own
+      plan.merges.push_back({0});
+      plan.bytes_written = fs::file_size(fs::path(current_filenames[0]));
+    }
+    report.merge_fan_in = plan.fan_in;
+    report.merge_block_size = plan.block_size;
+    report.merges = plan.merges.size();
+    report.merge_bytes = plan.bytes_written;
+
+    if (plan.merges.empty()) {
+      auto from = std::filesystem::path(current_filenames[0]);
+      auto to = std::filesystem::path(output.filename);
+
+      try {
+        std::filesystem::rename(from, to);
+      } catch (const std::filesystem::filesystem_error &e) {
+        if (std::filesystem::exists(to)) {
+          std::filesystem::remove(to);
         }
+        std::filesystem::copy_file(from, to);
+        std::filesystem::remove(from);
+      }
+      return finish_report(report, budget);
+    }
+
+    if (plan.fan_in != max_files || plan.block_size != block_size) {
+      io_reservation.reset();
+      io_reservation = MemoryReservation(
+          budget, (plan.fan_in + 1) * plan.block_size, "I/O buffers");
+    }
+    auto buffers = init_buffers(plan.fan_in, plan.block_size);
+
+    if (!merge_runs(current_filenames, plan, output, placement, workers,
+                    buffers, budget, remove_duplicates, comparator,
+                    time_control, active_files, run_format(options)))
+      clean_up_files(active_files);
+    return finish_report(report, budget);
+  }
+
+  /*
+   * Taking the runs by their first value, appends each one to the chain of
+   * runs with the greatest last value it follows, or starts a chain with it.
+   * Each chain becomes one file, so only the runs that overlap are left to
+   * merge. Runs without bounds are left alone. With duplicates removed,
+   * consecutive runs can't share a value. Returns the files left.
+   */
+  static std::vector<std::string>
+  concatenate_disjoint_runs(std::vector<RunFile> &run_files,
+                            bool remove_duplicates, comp_t &comparator,
+                            RUN_FORMAT format,
+                            std::set<std::string> &active_files,
+                            SortReport &report) {
+    std::vector<std::string> filenames;
+    std::vector<RunFile *> bounded;
+    for (auto &run_file : run_files) {
+      if (run_file.bounded)
+        bounded.push_back(&run_file);
+      else
+        filenames.push_back(run_file.filename);
     }
-    auto from = std::filesystem::path(current_filenames[0]);
-    auto to = std::filesystem::path(output_filename);
+    std::stable_sort(bounded.begin(), bounded.end(),
+                     [&](const RunFile *lhs, const RunFile *rhs) {
+                       return comparator(lhs->first, rhs->first);
+                     });
+    auto follows = [&](const RunFile *before, const RunFile *after) {
+      if (remove_duplicates)
+        return comparator(before->last, after->first);
+      return !comparator(after->first, before->last);
+    };
+
+    std::vector<std::vector<RunFile *>> chains;
+    for (auto *run_file : bounded) {
+      std::vector<RunFile *> *best = nullptr;
+      for (auto &chain : chains)
+        if (follows(chain.back(), run_file) &&
+            (!best || comparator(best->back()->last, chain.back()->last)))
+          best = &chain;
+      if (best)
+        best->push_back(run_file);
+      else
+        chains.push_back({run_file});
+    }
+    for (auto &chain : chains) {
+      append_runs(chain, format, active_files);
+      report.concatenated_runs += chain.size() - 1;
+      filenames.push_back(chain[0]->filename);
+    }
+    return filenames;
+  }
 
+  // Appends the data of the runs after the first one to it, in the kernel,
+  // and removes them. The header of the first run is rewritten for all the
+  // values.
+  static void append_runs(const std::vector<RunFile *> &chain,
+                          RUN_FORMAT format,
+                          std::set<std::string> &active_files) {
+    if (chain.size() < 2)
+      return;
+    const unsigned long data_start =
+        format == RAW_RUNS ? io_header_size<IOHandler>::value : 0;
+    unsigned long values = 0;
+    for (auto *run_file : chain)
+      values += run_file->values;
+    auto &target = *chain[0];
+    {
+      std::ofstream ofs(target.filename,
+                        std::ios::in | std::ios::out | std::ios::binary);
+      RunWriter writer(ofs, values, format);
+      writer.fix_headers(values);
+    }
+
+    int out = open(target.filename.c_str(), O_WRONLY);
+    if (out < 0)
+      throw std::runtime_error("couldn't open run " + target.filename);
+    auto offset = static_cast<unsigned long>(fs::file_size(target.filename));
     try {
-      std::filesystem::rename(from, to);
-    } catch (const std::filesystem::filesystem_error &e) {
-      if (std::filesystem::exists(to)) {
-        std::filesystem::remove(to);
+      for (std::size_t i = 1; i < chain.size(); i++) {
+        auto &filename = chain[i]->filename;
+        auto size = static_cast<unsigned long>(fs::file_size(filename));
+        if (size > data_start) {
+          int in = open(filename.c_str(), O_RDONLY);
+          if (in < 0)
+            throw std::runtime_error("couldn't open run " + filename);
+          try {
+            copy_file_bytes(in, data_start, out, offset, size - data_start);
+          } catch (...) {
+            close(in);
+            throw;
+          }
+          close(in);
+          offset += size - data_start;
+        }
+        remove(filename.c_str());
+        active_files.erase(filename);
       }
-      std::filesystem::copy_file(from, to);
-      std::filesystem::remove(from);
+    } catch (...) {
+      close(out);
+      throw;
     }
+    close(out);
+    target.values = values;
+    target.last = chain.back()->last;
+  }
+
+  static SortReport finish_report(SortReport &report,
+                                  const MemoryBudget &budget) {
+    report.memory_peak = budget.peak();
+    struct rusage usage {};
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      report.peak_rss = static_cast<unsigned long>(usage.ru_maxrss) * 1024;
+    return report;
+  }
+
+  // Bytes reserved by a merge pass of max_files runs, each with the block
+  // being merged and the one read ahead
+  static unsigned long merge_memory(int max_files, unsigned long block_size) {
+    return max_files * (2 * block_size + sizeof(int) + sizeof(const T *));
+  }
+
+  // Bytes per value needed to sort a run, on top of the values themselves
+  static unsigned long sort_memory_per_value(const SortOptions &options) {
+    if constexpr (has_radix_key<run_value_t>::value) {
+      // auxiliary vector of the radix sort
+      return sizeof(run_value_t);
+    }
+    if (options.sort_engine == SAMPLE_SORT)
+      return sizeof(unsigned short);
+    // merge copy of the sorted segments
+    return sizeof(run_value_t);
+  }
+
+  // Bytes used by a run with room for capacity values, and by sorting it
+  static unsigned long run_memory(const RunBuffer &run, unsigned long capacity,
+                                  const SortOptions &options) {
+    return run.storage.memory_usage() + run.values_memory +
+           capacity * (sizeof(run_value_t) + sort_memory_per_value(options));
+  }
+
+  /*
+   * Grows the capacity of values so that one more fits, while used bytes
+   * plus the old and new arrays, and extra_per_value bytes for each value of
+   * the new capacity, stay under memory_bound. Returns false if it cannot.
+   */
+  template <typename V>
+  static bool grow_within(std::vector<V> &values, unsigned long used,
+                          unsigned long extra_per_value,
+                          unsigned long memory_bound) {
+    if (used >= memory_bound)
+      return false;
+    const auto old_capacity = values.capacity();
+    const auto room = memory_bound - used;
+    const auto per_value = sizeof(V) + extra_per_value;
+    auto capacity = std::max<unsigned long>(2 * old_capacity, 1024);
+    // both arrays are alive while the values are moved
+    auto fits = [&](unsigned long c) {
+      return std::max(c * per_value, (old_capacity + c) * sizeof(V)) <= room;
+    };
+    if (!fits(capacity)) {
+      auto moving = room / sizeof(V);
+      capacity = std::min(room / per_value,
+                          moving > old_capacity ? moving - old_capacity : 0);
+    }
+    if (capacity <= old_capacity)
+      return false;
+    values.reserve(capacity);
+    return true;
   }
 
-private:
   static void clean_up_files(std::set<std::string> &active_files) {
     for (auto &file_name : active_files) {
       fs::remove(fs::path(file_name));
     }
   }
 
-  static void parallel_sort(std::vector<T> &data, int max_workers,
+  template <typename V>
+  static void parallel_sort(std::vector<V> &data, int max_workers,
                             unsigned long segment_size, bool remove_duplicates,
-                            comp_t &comparator, TC &time_control) {
+                            typename V::Comparator &comparator,
+                            TC &time_control, const SortOptions &options) {
+
+    // connectors with a radix key are sorted without comparisons, their key
+    // order must match their Comparator
+    if constexpr (has_radix_key<V>::value) {
+      RadixSort<V, TC>::sort(data, max_workers, time_control);
+      if constexpr (TC::with_time_control)
+        if (!time_control.tick())
+          return;
+      if (remove_duplicates)
+        data.erase(std::unique(data.begin(), data.end()), data.end());
+      return;
+    }
+
+    if (options.sort_engine == SAMPLE_SORT) {
+      SampleSort<V, TC>::sort(data, comparator, max_workers, time_control);
+      if constexpr (TC::with_time_control)
+        if (!time_control.tick())
+          return;
+      if (remove_duplicates)
+        data.erase(std::unique(data.begin(), data.end()), data.end());
+      return;
+    }
 
     std::vector<int> offsets = {0};
-    std::unordered_set<int> offsets_set;
     unsigned long accumulated_size = data[0].size();
     for (int i = 1; i < static_cast<int>(data.size()); i++) {
       accumulated_size += data[i].size();
       if (accumulated_size >= segment_size) {
         offsets.push_back(i);
-        offsets_set.insert(i);
         accumulated_size = 0;
       }
     }
     offsets.push_back(data.size());
-    offsets_set.insert(data.size());
 
     int parts = static_cast<int>(offsets.size()) - 1;
     int workers = std::min(max_workers, parts);
     if (workers == 1) {
-      IntroSort<T, TC>::sort(data, comparator, time_control);
+      IntroSort<V, TC>::sort(data, comparator, time_control);
       if constexpr (TC::with_time_control)
         if (!time_control.tick())
           return;
@@ -154,7 +877,7 @@ private:
         auto *tc_raw_ptr = tc_ptr.get();
         time_controls.push_back(std::move(tc_ptr));
         pool.add_task([i, &offsets, &data, &comparator, &tc_raw_ptr]() {
-          IntroSort<T, TC>::sort(data, comparator, *tc_raw_ptr, offsets[i],
+          IntroSort<V, TC>::sort(data, comparator, *tc_raw_ptr, offsets[i],
                                  offsets[i + 1]);
         });
       }
@@ -179,46 +902,37 @@ private:
       pool.wait_workers();
     }
 
-    PairComp pair_comp(comparator);
-    std::vector<T> result;
-    std::priority_queue<pair_T_int, std::vector<pair_T_int>, PairComp> pqueue(
-        pair_comp);
-
-    for (int i = 0; i < parts; i++) {
-      pqueue.push({data[offsets[i]], offsets[i]});
-    }
-
-    while (!pqueue.empty()) {
-      auto &current = pqueue.top();
-      result.push_back(current.first);
-      int next = current.second + 1;
-      pqueue.pop();
-      if (offsets_set.find(next) != offsets_set.end()) {
-        continue;
-      }
-      pqueue.push({data[next], next});
-    }
+    std::vector<V> result(data.size());
+    MultiwayMerge<V>::merge(data, offsets, result, workers, comparator);
 
     data = std::move(result);
     if (remove_duplicates)
       data.erase(std::unique(data.begin(), data.end()), data.end());
   }
 
+  // Run file_index of tmp_dir, named after the input without its directories
+  static std::string run_filename(const std::string &input_filename_base,
+                                  const std::string &tmp_dir,
+                                  int file_index) {
+    auto name = std::filesystem::path(input_filename_base).filename();
+    return (std::filesystem::path(tmp_dir) /
+            std::filesystem::path(name.string() + "-p" +
+                                  std::to_string(file_index)))
+        .string();
+  }
+
   static void create_file_part(const std::string &input_filename_base,
-                               const std::string &tmp_dir, int workers,
-                               std::vector<char> &buffer_out,
-                               unsigned long &accumulated_size,
-                               std::vector<T> &data, int &current_file_index,
-                               std::vector<std::string> &filenames,
+                               TempPlacement &placement, int workers,
+                               io_buffer &buffer_out, RunBuffer &run,
+                               int &current_file_index,
+                               std::vector<RunFile> &run_files,
                                bool remove_duplicates, comp_t &comparator,
                                TC &time_control,
-                               std::set<std::string> &active_files) {
-    accumulated_size = 0;
+                               std::set<std::string> &active_files,
+                               const SortOptions &options) {
     auto filename =
-        (std::filesystem::path(tmp_dir) /
-         std::filesystem::path(input_filename_base + "-p" +
-                               std::to_string(current_file_index++)))
-            .string();
+        run_filename(input_filename_base, placement.run_dir(),
+                     current_file_index++);
 
     active_files.insert(filename);
 
@@ -230,11 +944,18 @@ private:
     }
 
     std::ofstream ofs(filename, open_mode);
-    ofs.rdbuf()->pubsetbuf(buffer_out.data(),
-                           static_cast<std::streamsize>(buffer_out.size()));
-    filenames.push_back(filename);
-    parallel_sort(data, workers, 100'000'000, remove_duplicates, comparator,
-                  time_control);
+    if (!ofs.is_open())
+      throw std::runtime_error("couldn't open run " + filename);
+    io_streams<IOHandler>::attach_output(ofs, buffer_out);
+    run_files.push_back(RunFile{filename});
+    if constexpr (std::is_same_v<run_value_t, T>) {
+      parallel_sort(run.values, workers, 100'000'000, remove_duplicates,
+                    comparator, time_control, options);
+    } else {
+      typename run_value_t::Comparator run_comparator;
+      parallel_sort(run.values, workers, 100'000'000, remove_duplicates,
+                    run_comparator, time_control, options);
+    }
 
     if constexpr (TC::with_time_control)
       if (!time_control.tick()) {
@@ -242,22 +963,74 @@ private:
         return;
       }
 
-    typename IOHandler::Writer writer(ofs, data.size());
-    for (auto &line : data) {
+    RunWriter writer(ofs, run.values.size(), run_format(options));
+    for (auto &line : run.values) {
       // ofs << line;
       writer.write_value(line);
     }
-    data.clear();
+    auto &run_file = run_files.back();
+    run_file.values = run.values.size();
+    run_file.bounded = copy_bound(run.values.front(), run_file.first) &&
+                       copy_bound(run.values.back(), run_file.last);
+    run.clear();
   }
 
-  static std::vector<std::string>
-  split_file(const std::string &input_filename, const std::string &tmp_dir,
-             unsigned long memory_budget, int workers,
-             std::vector<char> &buffer_in, std::vector<char> &buffer_out,
-             bool remove_duplicates, comp_t &comparator, TC &time_control,
-             std::set<std::string> &active_files) {
+  /*
+   * Reads values into the run while the run, including the memory taken to
+   * sort it, stays under memory_bound, then reserves what it uses from the
+   * budget. Returns false once the input is exhausted.
+   */
+  template <typename Reader>
+  static bool fill_run(Reader &reader, RunBuffer &run,
+                       unsigned long memory_bound, MemoryBudget &budget,
+                       const SortOptions &options) {
+    bool has_more = true;
+    run_value_t current_val;
+    while (true) {
+      if (run.values.size() == run.values.capacity() &&
+          !grow_within(run.values,
+                       run.storage.memory_usage() + run.values_memory,
+                       sort_memory_per_value(options), memory_bound)) {
+        if (run.values.empty())
+          throw std::runtime_error("memory budget is too small for a run");
+        break;
+      }
+      bool was_read;
+      if constexpr (with_run_storage) {
+        was_read = reader.read_value(current_val, run.storage);
+      } else {
+        was_read = reader.read_value(current_val);
+      }
+      if (!was_read) {
+        has_more = false;
+        break;
+      }
+      auto value_bytes = value_memory<run_value_t>::of(current_val);
+      run.values_memory += value_bytes;
+      run.values.push_back(std::move(current_val));
+      // stop when a value like the last one could go over the bound
+      if (run_memory(run, run.values.capacity(), options) + value_bytes +
+              run.storage.growth_step() >
+          memory_bound)
+        break;
+    }
 
-    std::vector<std::string> filenames;
+    auto used = run_memory(run, run.values.capacity(), options);
+    if (used > run.reservation.size()) {
+      run.reservation.reset();
+      run.reservation = MemoryReservation(budget, used, "run");
+    }
+    return has_more;
+  }
+
+  static std::vector<RunFile>
+  split_file(const std::string &input_filename, TempPlacement &placement,
+             MemoryBudget &budget, int workers, io_buffer &buffer_in,
+             io_buffer &buffer_out, bool remove_duplicates, comp_t &comparator,
+             TC &time_control, std::set<std::string> &active_files,
+             const SortOptions &options) {
+
+    std::vector<RunFile> run_files;
 
     std::ios_base::openmode open_mode;
     if constexpr (DM == TEXT) {
@@ -271,38 +1044,335 @@ private:
         buffer_in.data(), static_cast<std::streamsize>(buffer_in.size()));
 
     int current_file_index = 0;
-    unsigned long accumulated_size = 0;
 
-    std::vector<T> data;
-    if constexpr (T::fixed_size) {
-      data.reserve(memory_budget / T::size());
+    const bool double_buffered = options.run_generation == DOUBLE_BUFFERED;
+
+    auto memory_bound = budget.available();
+    if (double_buffered)
+      memory_bound /= 2;
+
+    if constexpr (DM == TEXT || T::fixed_size) {
+      if (options.run_generation == PARALLEL_RANGES && workers > 1 &&
+          io_raw_records<IOHandler>::value)
+        return split_file_ranges(input_filename, placement, budget, workers,
+                                 buffer_in.size(), remove_duplicates,
+                                 comparator, time_control, active_files,
+                                 options);
     }
 
+    RunBuffer run(memory_bound);
+    // only used by the reader thread when double buffered
+    RunBuffer next_run(memory_bound);
+
     typename IOHandler::Reader reader(input_file);
+
+    if (options.run_generation == REPLACEMENT_SELECTION) {
+      replacement_selection(reader, input_filename, placement, memory_bound,
+                            budget, buffer_out, run_files, remove_duplicates,
+                            comparator, time_control, active_files, options);
+      return run_files;
+    }
+
+    bool has_more = fill_run(reader, run, memory_bound, budget, options);
+    while (!run.values.empty()) {
+      // the reader thread only touches reader and next_run while the current
+      // run is being sorted and written
+      std::future<bool> next_fill;
+      if (double_buffered && has_more)
+        next_fill = std::async(
+            std::launch::async, fill_run<typename IOHandler::Reader>,
+            std::ref(reader), std::ref(next_run), memory_bound,
+            std::ref(budget), std::cref(options));
+
+      create_file_part(input_filename, placement, workers, buffer_out, run,
+                       current_file_index, run_files, remove_duplicates,
+                       comparator, time_control, active_files, options);
+
+      if constexpr (TC::with_time_control)
+        if (!time_control.tick())
+          return {};
+
+      if (next_fill.valid()) {
+        has_more = next_fill.get();
+        std::swap(run, next_run);
+      } else if (has_more) {
+        has_more = fill_run(reader, run, memory_bound, budget, options);
+      }
+    }
+    return run_files;
+  }
+
+  /*
+   * Returns the boundaries of up to parts byte ranges of the input. Fixed size
+   * records are split at multiples of T::size() and text at the start of a
+   * line, both after the IOHandler header.
+   */
+  static std::vector<unsigned long>
+  input_ranges(const std::string &input_filename, int parts) {
+    const unsigned long data_start = io_header_size<IOHandler>::value;
+    const unsigned long file_size = fs::file_size(input_filename);
+    const unsigned long data_size =
+        file_size > data_start ? file_size - data_start : 0;
+
+    std::ifstream ifs(input_filename, std::ios::in | std::ios::binary);
+
+    std::vector<unsigned long> bounds = {data_start};
+    for (int i = 1; i < parts; i++) {
+      unsigned long bound;
+      if constexpr (DM == TEXT) {
+        bound = data_start + data_size * i / parts;
+        if (bound > data_start) {
+          // a range starts right after the newline that ends the previous one
+          ifs.seekg(static_cast<std::streamoff>(bound - 1));
+          ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+          bound = ifs.eof() ? file_size
+                            : static_cast<unsigned long>(ifs.tellg());
+          ifs.clear();
+        }
+      } else {
+        auto records = data_size / T::size();
+        bound = data_start + (records * i / parts) * T::size();
+      }
+      if (bound > bounds.back() && bound < file_size)
+        bounds.push_back(bound);
+    }
+    bounds.push_back(std::max(file_size, data_start));
+    return bounds;
+  }
+
+  static void split_range(const std::string &input_filename,
+                          TempPlacement &placement, int range_index,
+                          unsigned long range_start, unsigned long range_end,
+                          unsigned long memory_bound, MemoryBudget &budget,
+                          unsigned long buffer_size,
+                          std::vector<RunFile> &run_files,
+                          bool remove_duplicates, comp_t &comparator,
+                          TC &time_control,
+                          std::set<std::string> &active_files,
+                          const SortOptions &options) {
+    io_buffer buffer_in(buffer_size);
+    io_buffer buffer_out(buffer_size);
+
+    std::ios_base::openmode open_mode;
+    if constexpr (DM == TEXT) {
+      open_mode = std::ios::in;
+    } else {
+      open_mode = std::ios::in | std::ios::binary;
+    }
+    std::ifstream input_file(input_filename, open_mode);
+    input_file.rdbuf()->pubsetbuf(
+        buffer_in.data(), static_cast<std::streamsize>(buffer_in.size()));
+    input_file.seekg(static_cast<std::streamoff>(range_start));
+
+    RangeReader reader(input_file, range_end - range_start);
+
+    RunBuffer run(memory_bound);
+
+    auto filename_base = input_filename + "-r" + std::to_string(range_index);
+    int current_file_index = 0;
+    bool has_more = true;
+    while (has_more) {
+      has_more = fill_run(reader, run, memory_bound, budget, options);
+      if (run.values.empty())
+        break;
+      create_file_part(filename_base, placement, 1, buffer_out, run,
+                       current_file_index, run_files, remove_duplicates,
+                       comparator, time_control, active_files, options);
+      if constexpr (TC::with_time_control)
+        if (!time_control.tick())
+          return;
+    }
+  }
+
+  /*
+   * Run generation with one worker per byte range of the input. The memory
+   * left after the I/O buffers of the workers is shared between them and the
+   * runs are returned in input order.
+   */
+  static std::vector<RunFile>
+  split_file_ranges(const std::string &input_filename,
+                    TempPlacement &placement, MemoryBudget &budget,
+                    int workers, unsigned long buffer_size,
+                    bool remove_duplicates, comp_t &comparator,
+                    TC &time_control, std::set<std::string> &active_files,
+                    const SortOptions &options) {
+    auto bounds = input_ranges(input_filename, workers);
+    int parts = static_cast<int>(bounds.size()) - 1;
+
+    std::vector<std::vector<RunFile>> range_run_files(parts);
+    std::vector<std::set<std::string>> range_active_files(parts);
+    std::vector<std::unique_ptr<TC>> time_controls;
+    for (int i = 0; i < parts; i++) {
+      time_controls.push_back(std::make_unique<TC>(time_control));
+    }
+
+    MemoryReservation buffers_reservation(budget, 2 * parts * buffer_size,
+                                          "range I/O buffers");
+    auto memory_bound = budget.available() / parts;
+
+    ParallelWorkerPool pool(parts);
+    for (int i = 0; i < parts; i++) {
+      pool.add_task([i, &input_filename, &placement, &bounds, memory_bound,
+                     &budget, buffer_size, &range_run_files,
+                     remove_duplicates, &comparator, &time_controls,
+                     &range_active_files, &options]() {
+        split_range(input_filename, placement, i, bounds[i], bounds[i + 1],
+                    memory_bound, budget, buffer_size, range_run_files[i],
+                    remove_duplicates, comparator, *time_controls[i],
+                    range_active_files[i], options);
+      });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+
+    std::vector<RunFile> run_files;
+    for (int i = 0; i < parts; i++) {
+      active_files.insert(range_active_files[i].begin(),
+                          range_active_files[i].end());
+      run_files.insert(run_files.end(), range_run_files[i].begin(),
+                       range_run_files[i].end());
+    }
+
+    if constexpr (TC::with_time_control)
+      for (auto &tc_ptr : time_controls)
+        if (!tc_ptr->tick()) {
+          clean_up_files(active_files);
+          return {};
+        }
+
+    return run_files;
+  }
+
+  /*
+   * Replacement selection: the heap holds up to memory_bound worth of values,
+   * the smallest value of the current run is written and replaced by the next
+   * input value, which is deferred to the following run if it is smaller than
+   * the last written one. The heap array and the heap bytes of its values are
+   * accounted against memory_bound.
+   */
+  static void
+  replacement_selection(typename IOHandler::Reader &reader,
+                        const std::string &input_filename,
+                        TempPlacement &placement, unsigned long memory_bound,
+                        MemoryBudget &budget, io_buffer &buffer_out,
+                        std::vector<RunFile> &run_files,
+                        bool remove_duplicates, comp_t &comparator,
+                        TC &time_control, std::set<std::string> &active_files,
+                        const SortOptions &options) {
+    RunPairComp run_pair_comp(comparator);
+    std::vector<pair_T_int> heap;
+    MemoryReservation reservation;
+
+    unsigned long values_memory = 0;
+    unsigned long last_value_bytes = 0;
+    auto heap_memory = [&]() {
+      return heap.capacity() * sizeof(pair_T_int) + values_memory;
+    };
+    // true when one more value like the last one fits in the heap
+    auto has_room = [&]() {
+      if (heap.size() == heap.capacity() &&
+          !grow_within(heap, values_memory, 0, memory_bound))
+        return false;
+      return heap_memory() + last_value_bytes <= memory_bound;
+    };
+    auto account = [&]() {
+      if (heap_memory() > reservation.size()) {
+        reservation.reset();
+        reservation = MemoryReservation(budget, heap_memory(),
+                                        "replacement selection heap");
+      }
+    };
+
+    bool has_more = true;
     T current_val;
+    while (heap.empty() || has_room()) {
+      if (!reader.read_value(current_val)) {
+        has_more = false;
+        break;
+      }
+      last_value_bytes = value_memory<T>::of(current_val);
+      values_memory += last_value_bytes;
+      heap.push_back({std::move(current_val), 0});
+    }
+    account();
+    std::make_heap(heap.begin(), heap.end(), run_pair_comp);
 
-    const auto memory_bound = T::fixed_size ? memory_budget : memory_budget / 3;
-
-    while (reader.read_value(current_val)) {
-      if (accumulated_size >= memory_bound) {
-        create_file_part(input_filename, tmp_dir, workers, buffer_out,
-                         accumulated_size, data, current_file_index, filenames,
-                         remove_duplicates, comparator, time_control,
-                         active_files);
-        if constexpr (TC::with_time_control)
-          if (!time_control.tick())
-            return {};
-      }
-      data.push_back(current_val);
-      accumulated_size +=
-          (current_val.size() + 1) * sizeof(char) + sizeof(T) + sizeof(T *);
-    }
-    if (accumulated_size > 0)
-      create_file_part(input_filename, tmp_dir, workers, buffer_out,
-                       accumulated_size, data, current_file_index, filenames,
-                       remove_duplicates, comparator, time_control,
-                       active_files);
-    return filenames;
+    std::ios_base::openmode open_mode;
+    if constexpr (DM == TEXT) {
+      open_mode = std::ios::out;
+    } else {
+      open_mode = std::ios::out | std::ios::binary;
+    }
+
+    std::unique_ptr<std::ofstream> ofs;
+    std::unique_ptr<RunWriter> writer;
+    unsigned long written_values = 0;
+    int current_run = -1;
+    T last_value;
+
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), run_pair_comp);
+      auto current = std::move(heap.back());
+      heap.pop_back();
+
+      if (current.second != current_run) {
+        if (writer) {
+          writer->fix_headers(written_values);
+          ofs->flush();
+          run_files.back().values = written_values;
+          run_files.back().last = last_value;
+        }
+        writer = nullptr;
+        ofs = nullptr;
+        current_run = current.second;
+        auto filename = run_filename(input_filename, placement.run_dir(),
+                                     static_cast<int>(run_files.size()));
+        active_files.insert(filename);
+        run_files.push_back(RunFile{filename, 0, true, current.first, T()});
+        ofs = std::make_unique<std::ofstream>(filename, open_mode);
+        if (!ofs->is_open())
+          throw std::runtime_error("couldn't open run " + filename);
+        io_streams<IOHandler>::attach_output(*ofs, buffer_out);
+        written_values = 0;
+        writer = std::make_unique<RunWriter>(*ofs, written_values,
+                                             run_format(options));
+      }
+
+      if (written_values == 0 || !remove_duplicates ||
+          last_value != current.first) {
+        writer->write_value(current.first);
+        written_values++;
+      }
+      values_memory -= value_memory<T>::of(current.first);
+      last_value = std::move(current.first);
+
+      while (has_more && (heap.empty() || has_room())) {
+        if (!reader.read_value(current_val)) {
+          has_more = false;
+          break;
+        }
+        last_value_bytes = value_memory<T>::of(current_val);
+        values_memory += last_value_bytes;
+        int run = comparator(current_val, last_value) ? current_run + 1
+                                                      : current_run;
+        heap.push_back({std::move(current_val), run});
+        std::push_heap(heap.begin(), heap.end(), run_pair_comp);
+      }
+      account();
+
+      if constexpr (TC::with_time_control)
+        if (!time_control.tick()) {
+          clean_up_files(active_files);
+          return;
+        }
+    }
+
+    if (writer) {
+      writer->fix_headers(written_values);
+      ofs->flush();
+      run_files.back().values = written_values;
+      run_files.back().last = last_value;
+    }
   }
 
   std::string concatenate_filenames(const std::vector<std::string> &filenames) {
@@ -317,59 +1387,218 @@ private:
     return ss.str();
   }
 
-  static bool
-  fill_with_file(std::list<T> &data_block,
-                 std::unique_ptr<std::ifstream> &input_file,
-                 std::unique_ptr<typename IOHandler::Reader> &reader,
-                 unsigned long block_size, TC &time_control) {
+  // Values read ahead from a run, consumed from head and refilled in bulk
+  struct MergeBlock {
+    std::vector<T> values;
+    std::size_t head = 0;
+
+    bool empty() const { return head == values.size(); }
+  };
+
+  // Bytes taken by a value in a merge block
+  static unsigned long block_value_memory(const T &value) {
+    return value_memory<T>::of(value) + sizeof(T);
+  }
+
+  /*
+   * Replaces the consumed values of the block with the next block_size bytes
+   * of the run, read in place at the end of the vector.
+   */
+  template <typename Reader>
+  static bool fill_with_file(MergeBlock &block,
+                             std::unique_ptr<std::ifstream> &input_file,
+                             std::unique_ptr<Reader> &reader,
+                             unsigned long block_size, TC &time_control) {
+    block.values.clear();
+    block.head = 0;
+    if constexpr (T::fixed_size) {
+      block.values.reserve(std::max(block_size / sizeof(T), 1UL));
+    }
 
-    T current_value;
     unsigned long accumulated_size = 0;
     while (accumulated_size < block_size) {
-
-      if (!reader->read_value(current_value)) {
+      block.values.emplace_back();
+      if (!reader->read_value(block.values.back())) {
+        block.values.pop_back();
         input_file = nullptr;
         break;
       }
       if constexpr (TC::with_time_control)
         if (!time_control.tick())
           return false;
-      accumulated_size +=
-          (current_value.size() + 1) * sizeof(char) + sizeof(T) + sizeof(T *);
-      data_block.push_back(current_value);
-    }
-    return !data_block.empty();
-  }
-
-  static void block_update(
-      int index, std::vector<std::list<T>> &data,
-      std::vector<std::unique_ptr<std::ifstream>> &opened_files,
-      std::vector<std::unique_ptr<typename IOHandler::Reader>> &readers,
-      std::priority_queue<pair_T_int, std::vector<pair_T_int>, PairComp>
-          &priority_queue,
-      unsigned long block_size, TC &time_control) {
-    if (data[index].empty() && opened_files[index]) {
-      if (!fill_with_file(data[index], opened_files[index], readers[index],
-                          block_size, time_control))
-        return;
-    } else if (data[index].empty()) {
-      return;
+      accumulated_size += block_value_memory(block.values.back());
     }
-    auto current_str = data[index].front();
-    priority_queue.push({std::move(current_str), index});
-    data[index].pop_front();
+    return !block.values.empty();
   }
 
-  static std::string merge_pass(const std::vector<std::string> &filenames,
-                                int start, int end, const std::string &tmp_dir,
-                                unsigned long block_size,
-                                std::vector<std::vector<char>> &buffers,
-                                bool remove_duplicates, comp_t &comparator,
-                                TC &time_control,
-                                std::set<std::string> &active_files) {
+  /*
+   * Read-ahead of the runs of a merge. A background I/O thread keeps the
+   * block that follows the one being merged loaded for every run, so the
+   * merge swaps blocks and only waits when the disk is behind. The readers
+   * and time control are only used by the I/O thread.
+   */
+  template <typename Reader> class ReadAhead {
+    std::vector<std::unique_ptr<std::ifstream>> &opened_files;
+    std::vector<std::unique_ptr<Reader>> &readers;
+    const unsigned long block_size;
+    TC &time_control;
+
+    std::vector<MergeBlock> next;
+    // next[i] is loaded, and the run has no blocks after it
+    std::vector<char> ready;
+    std::vector<char> exhausted;
+    std::deque<int> requests;
+    bool stopping;
+    bool halted;
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread io_thread;
+
+    void load_blocks() {
+      while (true) {
+        int index;
+        {
+          std::unique_lock<std::mutex> ul(mutex);
+          cv.wait(ul, [&]() { return stopping || !requests.empty(); });
+          if (stopping)
+            return;
+          index = requests.front();
+          requests.pop_front();
+        }
+        auto &block = next[index];
+        bool filled = false;
+        std::exception_ptr load_error;
+        try {
+          filled = opened_files[index] &&
+                   fill_with_file(block, opened_files[index], readers[index],
+                                  block_size, time_control);
+        } catch (...) {
+          load_error = std::current_exception();
+        }
 
-    std::vector<std::unique_ptr<std::ifstream>> opened_files;
+        std::lock_guard<std::mutex> lg(mutex);
+        if (load_error) {
+          error = load_error;
+          halted = true;
+        } else if (!filled && !block.empty()) {
+          // fill_with_file stopped on the time control
+          halted = true;
+        } else {
+          ready[index] = true;
+          exhausted[index] = !opened_files[index];
+        }
+        cv.notify_all();
+      }
+    }
+
+  public:
+    ReadAhead(std::vector<std::unique_ptr<std::ifstream>> &opened_files,
+              std::vector<std::unique_ptr<Reader>> &readers,
+              unsigned long block_size, TC &time_control)
+        : opened_files(opened_files), readers(readers), block_size(block_size),
+          time_control(time_control), next(readers.size()),
+          ready(readers.size(), 0), exhausted(readers.size(), 0),
+          stopping(false), halted(false) {
+      for (int i = 0; i < static_cast<int>(readers.size()); i++)
+        requests.push_back(i);
+      io_thread = std::thread([this]() { load_blocks(); });
+    }
 
+    ReadAhead(const ReadAhead &) = delete;
+    ReadAhead &operator=(const ReadAhead &) = delete;
+
+    ~ReadAhead() {
+      {
+        std::lock_guard<std::mutex> lg(mutex);
+        stopping = true;
+      }
+      cv.notify_all();
+      io_thread.join();
+    }
+
+    /*
+     * Swaps the consumed block of a run with its next one and queues the
+     * load of the block after. Returns false once the run is exhausted or
+     * the I/O thread halted.
+     */
+    bool next_block(int index, MergeBlock &block) {
+      std::unique_lock<std::mutex> ul(mutex);
+      cv.wait(ul,
+              [&]() { return ready[index] || exhausted[index] || halted; });
+      if (error)
+        std::rethrow_exception(error);
+      if (!ready[index])
+        return false;
+      std::swap(block, next[index]);
+      ready[index] = false;
+      if (!block.empty() && !exhausted[index]) {
+        requests.push_back(index);
+        cv.notify_all();
+      }
+      return !block.empty();
+    }
+
+    bool stopped() {
+      std::lock_guard<std::mutex> lg(mutex);
+      return halted;
+    }
+  };
+
+  /*
+   * Merges the runs read by readers into writer through a loser tree and
+   * counts the written values. Returns false if the sort was stopped.
+   */
+  template <typename Reader, typename Writer>
+  static bool
+  merge_readers(std::vector<std::unique_ptr<std::ifstream>> &opened_files,
+                std::vector<std::unique_ptr<Reader>> &readers,
+                unsigned long block_size, Writer &writer,
+                unsigned long &written_values, bool remove_duplicates,
+                comp_t &comparator, TC &time_control) {
+    std::vector<MergeBlock> data(readers.size());
+    ReadAhead<Reader> read_ahead(opened_files, readers, block_size,
+                                 time_control);
+
+    std::vector<const T *> heads;
+    for (int i = 0; i < static_cast<int>(data.size()); i++)
+      heads.push_back(read_ahead.next_block(i, data[i]) ? &data[i].values[0]
+                                                        : nullptr);
+    if (read_ahead.stopped())
+      return false;
+    LoserTree<T> tree(std::move(heads), comparator);
+
+    T last_value;
+    bool first = true;
+    while (!tree.empty()) {
+      int index = tree.winner();
+      auto &block = data[index];
+      auto &current = block.values[block.head];
+      if (first || !remove_duplicates || (last_value != current)) {
+        first = false;
+        writer.write_value(current);
+        written_values++;
+        // the head is consumed, so it is moved out of its block
+        if (remove_duplicates)
+          last_value = std::move(current);
+      }
+
+      block.head++;
+      if (!block.empty()) {
+        tree.replace_winner(&block.values[block.head]);
+      } else if (read_ahead.next_block(index, block)) {
+        tree.replace_winner(&block.values[block.head]);
+      } else {
+        if (read_ahead.stopped())
+          return false;
+        tree.replace_winner(nullptr);
+      }
+    }
+    return true;
+  }
+
+  static std::string create_merge_file(const std::string &tmp_dir) {
     auto result_template =
         (std::filesystem::path(tmp_dir) / (generate_uuid_v4() + "_m_XXXXXX"))
             .string();
@@ -378,12 +1607,30 @@ private:
               mut_fname_template.data());
     mut_fname_template[result_template.size()] = '\0';
     int created = mkstemp(mut_fname_template.data());
-    auto result_filename =
-        std::string(mut_fname_template.begin(), mut_fname_template.end());
+    auto result_filename = std::string(mut_fname_template.data());
 
-    if (!created)
+    if (created == -1)
       throw std::runtime_error("couldn't generate tmp file with name " +
                                result_filename);
+    close(created);
+    return result_filename;
+  }
+
+  // Merges the files, runs in input_format, into the output and removes
+  // them. Returns false if the sort was stopped.
+  static bool merge_pass(const std::vector<std::string> &filenames,
+                         const MergeOutput &output, unsigned long block_size,
+                         std::vector<io_buffer> &buffers,
+                         MemoryBudget &budget, bool remove_duplicates,
+                         comp_t &comparator, TC &time_control,
+                         std::set<std::string> &active_files,
+                         std::mutex &files_mutex,
+                         RUN_FORMAT input_format = RAW_RUNS) {
+
+    MemoryReservation blocks_reservation(
+        budget, merge_memory(filenames.size(), block_size), "merge blocks");
+
+    std::vector<std::unique_ptr<std::ifstream>> opened_files;
 
     std::ios_base::openmode open_mode_write;
     std::ios_base::openmode open_mode_read;
@@ -396,124 +1643,614 @@ private:
       open_mode_read = std::ios::in | std::ios::binary;
     }
 
-    active_files.insert(result_filename);
-
-    PairComp pair_cmp(comparator);
-    std::priority_queue<pair_T_int, std::vector<pair_T_int>, PairComp> pqueue(
-        pair_cmp);
-
-    std::vector<std::unique_ptr<typename IOHandler::Reader>> readers;
+    std::vector<std::unique_ptr<RunReader>> readers;
     readers.reserve(opened_files.size());
-    for (int i = start; i < end; i++) {
+    for (size_t i = 0; i < filenames.size(); i++) {
 
       auto ifs_ptr =
           std::make_unique<std::ifstream>(filenames[i], open_mode_read);
-      ifs_ptr->rdbuf()->pubsetbuf(
-          buffers[i - start].data(),
-          static_cast<std::streamsize>(buffers[i - start].size()));
+      io_streams<IOHandler>::attach_input(*ifs_ptr, buffers[i]);
 
-      auto reader = std::make_unique<typename IOHandler::Reader>(*ifs_ptr);
+      auto reader = std::make_unique<RunReader>(*ifs_ptr, input_format);
       readers.push_back(std::move(reader));
       opened_files.push_back(std::move(ifs_ptr));
     }
 
-    std::vector<std::list<T>> data;
+    unsigned long written_values = 0;
+    if (output.consumer) {
+      ConsumerWriter writer(*output.consumer);
+      if (!merge_readers(opened_files, readers, block_size, writer,
+                         written_values, remove_duplicates, comparator,
+                         time_control))
+        return false;
+    } else {
+      std::ofstream ofs(output.filename, open_mode_write);
+      if (!ofs.is_open())
+        throw std::runtime_error("couldn't open " + output.filename);
+      io_streams<IOHandler>::attach_output(ofs, buffers.back());
 
-    T current_value;
-    for (size_t i = 0; i < readers.size(); i++) {
-      auto &reader = readers[i];
-      unsigned long accumulated_size = 0;
+      RunWriter writer(ofs, written_values, output.format);
+      if (!merge_readers(opened_files, readers, block_size, writer,
+                         written_values, remove_duplicates, comparator,
+                         time_control))
+        return false;
 
-      std::list<T> current_block;
-      while (accumulated_size <= block_size) {
-        if (!reader->read_value(current_value)) {
-          opened_files[i] = nullptr;
-          break;
-        }
-        accumulated_size +=
-            (current_value.size() + 1) * sizeof(char) + sizeof(T) + sizeof(T *);
-        current_block.push_back(current_value);
+      writer.fix_headers(written_values);
+
+      ofs.flush();
+      ofs.close();
+    }
+
+    std::lock_guard<std::mutex> lg(files_mutex);
+    for (auto &filename : filenames) {
+      remove(filename.c_str());
+      active_files.erase(filename);
+    }
+
+    return true;
+  }
+
+  // Start of the first record of a run at or after position, capped at end
+  static unsigned long record_start(std::ifstream &ifs, unsigned long position,
+                                    unsigned long end) {
+    const unsigned long data_start = io_header_size<IOHandler>::value;
+    if (position <= data_start)
+      return data_start;
+    if constexpr (DM == TEXT) {
+      ifs.clear();
+      ifs.seekg(static_cast<std::streamoff>(position - 1));
+      ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+      if (!ifs) {
+        ifs.clear();
+        return end;
       }
-      data.push_back(std::move(current_block));
+      return std::min(end, static_cast<unsigned long>(ifs.tellg()));
+    } else {
+      auto records = (position - data_start + T::size() - 1) / T::size();
+      return std::min(end, data_start + records * T::size());
     }
+  }
 
-    for (int i = 0; i < static_cast<int>(data.size()); i++) {
-      block_update(i, data, opened_files, readers, pqueue, block_size,
-                   time_control);
-      if constexpr (TC::with_time_control)
-        if (!time_control.tick())
-          return "";
+  // Reads the record starting at position and returns where the next starts
+  static unsigned long read_record(std::ifstream &ifs, unsigned long position,
+                                   T &value) {
+    ifs.clear();
+    ifs.seekg(static_cast<std::streamoff>(position));
+    T::read_value(ifs, value);
+    if constexpr (DM == TEXT) {
+      return position + value.size() + 1;
+    } else {
+      return position + T::size();
+    }
+  }
+
+  /*
+   * Start of the first record of [begin, end) of a sorted run that is not
+   * less than key, or end. Bisects byte offsets, aligned to the next record.
+   */
+  static unsigned long run_lower_bound(std::ifstream &ifs, unsigned long begin,
+                                       unsigned long end, const T &key,
+                                       comp_t &comparator) {
+    T value;
+    while (begin < end) {
+      auto middle = record_start(ifs, begin + (end - begin) / 2, end);
+      // no record starts in the upper half
+      if (middle >= end)
+        middle = begin;
+      auto next = read_record(ifs, middle, value);
+      if (comparator(value, key))
+        begin = next;
+      else
+        end = middle;
+    }
+    return begin;
+  }
+
+  // Sorted and distinct keys cutting the values of the runs in about equal
+  // parts, sampled from every run in proportion to its size
+  static std::vector<T>
+  select_run_splitters(const std::vector<std::string> &filenames,
+                       const std::vector<unsigned long> &run_ends, int parts,
+                       comp_t &comparator) {
+    const unsigned long data_start = io_header_size<IOHandler>::value;
+    const unsigned long total_samples = 16UL * parts;
+    unsigned long total_size = 0;
+    for (auto run_end : run_ends)
+      total_size += run_end - data_start;
+
+    std::vector<T> samples;
+    for (int r = 0; r < static_cast<int>(run_ends.size()); r++) {
+      auto run_size = run_ends[r] - data_start;
+      if (run_size == 0)
+        continue;
+      auto run_samples = std::max(1UL, total_samples * run_size / total_size);
+      std::ifstream ifs(filenames[r], std::ios::in | std::ios::binary);
+      for (unsigned long s = 1; s <= run_samples; s++) {
+        auto position = record_start(
+            ifs, data_start + run_size * s / (run_samples + 1), run_ends[r]);
+        if (position >= run_ends[r])
+          continue;
+        T value;
+        read_record(ifs, position, value);
+        samples.push_back(std::move(value));
+      }
+    }
+    std::sort(samples.begin(), samples.end(), comparator);
+
+    std::vector<T> splitters;
+    for (int p = 1; p < parts && !samples.empty(); p++) {
+      auto &candidate = samples[samples.size() * p / parts];
+      if (splitters.empty() || comparator(splitters.back(), candidate))
+        splitters.push_back(candidate);
+    }
+    return splitters;
+  }
+
+  /*
+   * Merges [begin[r], end[r]) of every run into output_filename, either into
+   * a new file when fresh_file or at offset of an existing file.
+   */
+  static bool merge_part(const std::vector<std::string> &filenames,
+                         const std::vector<unsigned long> &begin,
+                         const std::vector<unsigned long> &end,
+                         const std::string &output_filename, bool fresh_file,
+                         unsigned long offset,
+                         std::vector<io_buffer> &buffers,
+                         unsigned long block_size, bool remove_duplicates,
+                         comp_t &comparator, TC &time_control,
+                         unsigned long &written_values) {
+    std::vector<std::unique_ptr<std::ifstream>> opened_files;
+    std::vector<std::unique_ptr<RangeReader>> readers;
+    for (int r = 0; r < static_cast<int>(begin.size()); r++) {
+      if (begin[r] == end[r]) {
+        opened_files.push_back(nullptr);
+        readers.push_back(nullptr);
+        continue;
+      }
+      auto ifs_ptr = std::make_unique<std::ifstream>(
+          filenames[r], std::ios::in | std::ios::binary);
+      io_streams<IOHandler>::attach_input(*ifs_ptr, buffers[r]);
+      ifs_ptr->seekg(static_cast<std::streamoff>(begin[r]));
+      readers.push_back(
+          std::make_unique<RangeReader>(*ifs_ptr, end[r] - begin[r]));
+      opened_files.push_back(std::move(ifs_ptr));
     }
 
-    std::ofstream ofs(result_filename, open_mode_write);
+    std::ofstream ofs;
+    if (fresh_file) {
+      ofs.open(output_filename, std::ios::out | std::ios::binary);
+    } else {
+      // other parts write the rest of the file at the same time
+      ofs.open(output_filename,
+               std::ios::in | std::ios::out | std::ios::binary);
+    }
+    io_streams<IOHandler>::attach_output(ofs, buffers.back());
+    ofs.seekp(static_cast<std::streamoff>(offset));
+
+    DefaultIOHandler::Writer writer(ofs, 0);
+    bool completed =
+        merge_readers(opened_files, readers, block_size, writer,
+                      written_values, remove_duplicates, comparator,
+                      time_control);
+    ofs.flush();
+    return completed;
+  }
+
+  /*
+   * Merge of the files with one thread per set of buffers. The runs
+   * are cut into key ranges by splitters sampled from them, found by binary
+   * search inside every file, and each thread merges one key range of all
+   * the runs. Without duplicate removal the size of every range is known and
+   * the threads write at their own offset of the result, otherwise each range
+   * is merged into a file of its own and appended to the result. Only for
+   * IOHandlers with raw_records. Returns false if the sort was stopped.
+   */
+  static bool parallel_merge_pass(
+      const std::vector<std::string> &filenames,
+      const std::string &result_filename, TempPlacement &placement,
+      unsigned long block_size,
+      std::vector<std::vector<io_buffer> *> &part_buffers,
+      MemoryBudget &budget, bool remove_duplicates, comp_t &comparator,
+      TC &time_control, std::set<std::string> &active_files,
+      std::mutex &files_mutex) {
+    const unsigned long data_start = io_header_size<IOHandler>::value;
+    const int runs = static_cast<int>(filenames.size());
+
+    std::vector<unsigned long> run_ends;
+    for (auto &filename : filenames)
+      run_ends.push_back(std::max<unsigned long>(
+          fs::file_size(fs::path(filename)), data_start));
+
+    auto splitters = select_run_splitters(
+        filenames, run_ends, static_cast<int>(part_buffers.size()),
+        comparator);
+    const int parts = static_cast<int>(splitters.size()) + 1;
+    if (parts == 1)
+      return merge_pass(filenames, MergeOutput{result_filename, nullptr},
+                        block_size, *part_buffers[0], budget,
+                        remove_duplicates, comparator, time_control,
+                        active_files, files_mutex);
+
+    // bounds[p][r] is where part p starts inside run r
+    std::vector<std::vector<unsigned long>> bounds(
+        parts + 1, std::vector<unsigned long>(runs));
+    for (int r = 0; r < runs; r++) {
+      std::ifstream ifs(filenames[r], std::ios::in | std::ios::binary);
+      bounds[0][r] = data_start;
+      bounds[parts][r] = run_ends[r];
+      for (int p = 1; p < parts; p++)
+        bounds[p][r] = run_lower_bound(ifs, bounds[p - 1][r], run_ends[r],
+                                       splitters[p - 1], comparator);
+    }
+
+    MemoryReservation blocks_reservation(
+        budget, parts * merge_memory(runs, block_size), "merge blocks");
+
+    std::vector<std::string> part_filenames(parts);
+    std::vector<unsigned long> part_offsets(parts, 0);
+    if (remove_duplicates) {
+      const auto &part_dir = placement.merge_dir(filenames);
+      std::lock_guard<std::mutex> lg(files_mutex);
+      for (auto &part_filename : part_filenames) {
+        part_filename = create_merge_file(part_dir);
+        active_files.insert(part_filename);
+      }
+    } else {
+      unsigned long offset = data_start;
+      for (int p = 0; p < parts; p++) {
+        part_filenames[p] = result_filename;
+        part_offsets[p] = offset;
+        for (int r = 0; r < runs; r++)
+          offset += bounds[p + 1][r] - bounds[p][r];
+      }
+      std::ofstream(result_filename, std::ios::out | std::ios::binary);
+      fs::resize_file(fs::path(result_filename), offset);
+    }
+
+    std::vector<unsigned long> part_values(parts, 0);
+    std::vector<char> part_completed(parts, 0);
+    std::vector<std::unique_ptr<TC>> time_controls;
+    ParallelWorkerPool pool(parts);
+    for (int p = 0; p < parts; p++) {
+      time_controls.push_back(std::make_unique<TC>(time_control));
+      auto *tc_raw_ptr = time_controls.back().get();
+      pool.add_task([&, p, tc_raw_ptr]() {
+        auto part_comparator = comparator;
+        part_completed[p] = merge_part(
+            filenames, bounds[p], bounds[p + 1], part_filenames[p],
+            remove_duplicates, part_offsets[p], *part_buffers[p], block_size,
+            remove_duplicates, part_comparator, *tc_raw_ptr, part_values[p]);
+      });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
 
-    ofs.rdbuf()->pubsetbuf(
-        buffers[buffers.size() - 1].data(),
-        static_cast<std::streamsize>(buffers[buffers.size() - 1].size()));
+    for (int p = 0; p < parts; p++) {
+      if (!part_completed[p])
+        return false;
+      if constexpr (TC::with_time_control)
+        if (!time_controls[p]->tick())
+          return false;
+    }
 
     unsigned long written_values = 0;
-    typename IOHandler::Writer writer(ofs, written_values);
-    T last_value;
-    bool first = true;
-    while (!pqueue.empty()) {
-      auto &current = pqueue.top();
-      int index = current.second;
-      if (first || !remove_duplicates || (last_value != current.first)) {
-        first = false;
-        // ofs << current.first;
-        writer.write_value(current.first);
-        written_values++;
+    for (auto values : part_values)
+      written_values += values;
+
+    {
+      std::ofstream ofs;
+      if (remove_duplicates)
+        ofs.open(result_filename, std::ios::out | std::ios::binary);
+      else
+        ofs.open(result_filename,
+                 std::ios::in | std::ios::out | std::ios::binary);
+      typename IOHandler::Writer writer(ofs, written_values);
+      if (remove_duplicates) {
+        std::lock_guard<std::mutex> lg(files_mutex);
+        for (auto &part_filename : part_filenames) {
+          if (fs::file_size(fs::path(part_filename)) > 0) {
+            std::ifstream ifs(part_filename, std::ios::in | std::ios::binary);
+            ofs << ifs.rdbuf();
+          }
+          remove(part_filename.c_str());
+          active_files.erase(part_filename);
+        }
       }
+      writer.fix_headers(written_values);
+    }
 
-      last_value = current.first;
-      pqueue.pop();
-      block_update(index, data, opened_files, readers, pqueue, block_size,
-                   time_control);
+    std::lock_guard<std::mutex> lg(files_mutex);
+    for (auto &filename : filenames) {
+      remove(filename.c_str());
+      active_files.erase(filename);
     }
 
-    writer.fix_headers(written_values);
+    return true;
+  }
 
-    ofs.flush();
-    ofs.close();
+  // Merges that reduce the runs to one file, merge i writes file runs + i
+  struct MergePlan {
+    int fan_in = 0;
+    unsigned long block_size = 0;
+    std::vector<std::vector<int>> merges;
+    unsigned long bytes_written = 0;
+  };
 
-    for (int i = start; i < end; i++) {
-      remove(filenames.at(i).c_str());
-      active_files.erase(filenames.at(i));
+  /*
+   * Huffman schedule merging fan_in files at a time, smallest first. The
+   * first merge takes just enough runs for every later one to be full, which
+   * minimizes the bytes written over all merges.
+   */
+  static MergePlan huffman_merges(const std::vector<unsigned long> &run_sizes,
+                                  int fan_in) {
+    MergePlan plan;
+    plan.fan_in = fan_in;
+    using sized_file = std::pair<unsigned long, int>;
+    std::priority_queue<sized_file, std::vector<sized_file>,
+                        std::greater<sized_file>>
+        smallest;
+    for (int i = 0; i < static_cast<int>(run_sizes.size()); i++)
+      smallest.emplace(run_sizes[i], i);
+
+    int next_file = static_cast<int>(run_sizes.size());
+    int files = static_cast<int>(smallest.size());
+    int take = files <= fan_in ? files : (files - 2) % (fan_in - 1) + 2;
+    while (smallest.size() > 1) {
+      std::vector<int> inputs;
+      unsigned long size = 0;
+      for (int i = 0; i < take; i++) {
+        size += smallest.top().first;
+        inputs.push_back(smallest.top().second);
+        smallest.pop();
+      }
+      plan.merges.push_back(std::move(inputs));
+      plan.bytes_written += size;
+      smallest.emplace(size, next_file++);
+      take = std::min(fan_in, static_cast<int>(smallest.size()));
     }
+    return plan;
+  }
 
-    return result_filename;
+  // Largest aligned block, up to max_merge_block, with which a merge of
+  // fan_in files fits in memory together with its I/O buffers
+  static unsigned long merge_block_for(int fan_in, unsigned long memory) {
+    const auto per_file = sizeof(int) + sizeof(const T *);
+    if (memory <= fan_in * per_file)
+      return 0;
+    auto block = (memory - fan_in * per_file) / (3 * fan_in + 1);
+    return std::min(max_merge_block,
+                    block / merge_block_alignment * merge_block_alignment);
   }
 
-  static std::vector<std::string>
-  merge_bottom_up(const std::vector<std::string> &filenames,
-                  const std::string &tmp_dir, int max_files,
-                  unsigned long block_size,
-                  std::vector<std::vector<char>> &buffers,
-                  bool remove_duplicates, comp_t &comparator, TC &time_control,
-                  std::set<std::string> &active_files) {
-    std::vector<std::string> result_filenames;
-
-    int level_passes = static_cast<int>(filenames.size() / max_files) +
-                       (filenames.size() % max_files != 0 ? 1 : 0);
-    for (int current_pass = 0; current_pass < level_passes; current_pass++) {
-      auto pass_file =
-          merge_pass(filenames, current_pass * max_files,
-                     std::min<int>((current_pass + 1) * max_files,
-                                   static_cast<int>(filenames.size())),
-                     tmp_dir, block_size, buffers, remove_duplicates,
-                     comparator, time_control, active_files);
-      if constexpr (TC::with_time_control)
-        if (!time_control.tick())
-          return {};
-      result_filenames.push_back(pass_file);
+  /*
+   * Merge plan for the runs. With BUDGET_FAN_IN every fan-in up to max_files
+   * is priced at the bytes its schedule writes plus seek_cost_bytes per
+   * block, with the largest block that lets one merge per worker fit in
+   * memory. Fewer merges at once are planned only when that leaves no room
+   * for blocks of block_size.
+   */
+  static MergePlan plan_merges(const std::vector<std::string> &filenames,
+                               int workers, int max_files,
+                               unsigned long block_size, unsigned long memory,
+                               const SortOptions &options) {
+    const unsigned long data_start = io_header_size<IOHandler>::value;
+    std::vector<unsigned long> run_sizes;
+    for (auto &filename : filenames) {
+      auto size = fs::file_size(fs::path(filename));
+      run_sizes.push_back(size > data_start ? size - data_start : 0);
     }
 
-    return result_filenames;
+    MergePlan best;
+    double best_cost = 0;
+    const int max_fan_in =
+        std::min(max_files, static_cast<int>(run_sizes.size()));
+    if (options.merge_sizing == BUDGET_FAN_IN) {
+      for (int slots = std::max(workers, 1); slots > 0 && best.merges.empty();
+           slots--) {
+        for (int fan_in = 2; fan_in <= max_fan_in; fan_in++) {
+          auto block = merge_block_for(fan_in, memory / slots);
+          if (block < block_size)
+            break;
+          auto plan = huffman_merges(run_sizes, fan_in);
+          auto cost = static_cast<double>(plan.bytes_written) *
+                      (1.0 + static_cast<double>(seek_cost_bytes) /
+                                 static_cast<double>(block));
+          if (best.merges.empty() || cost < best_cost) {
+            best = std::move(plan);
+            best.block_size = block;
+            best_cost = cost;
+          }
+        }
+      }
+    }
+    if (best.merges.empty()) {
+      best = huffman_merges(run_sizes, max_files);
+      best.block_size = block_size;
+    }
+    return best;
+  }
+
+  /*
+   * Runs the merges of the plan, the last one into output, and returns false
+   * if the sort was stopped. A merge is queued on the worker pool as soon as
+   * all of its input files exist, so independent merges overlap. Every
+   * running merge has its own I/O buffers, as many merges run at once as
+   * there are workers and room in the memory budget for their buffers and
+   * blocks. The final merge, which runs alone, is split over all of them
+   * unless a consumer needs the values in order. Runs in an encoded format
+   * are merged into runs of that format, and the final merge decodes them in
+   * a single pass since parts of an encoded run can't be found by offset.
+   * Merge outputs are written where placement puts them, away from the
+   * directories of their inputs.
+   */
+  static bool merge_runs(const std::vector<std::string> &filenames,
+                         const MergePlan &plan, const MergeOutput &output,
+                         TempPlacement &placement, int workers,
+                         std::vector<io_buffer> &buffers,
+                         MemoryBudget &budget, bool remove_duplicates,
+                         comp_t &comparator, TC &time_control,
+                         std::set<std::string> &active_files,
+                         RUN_FORMAT format) {
+    const int fan_in = plan.fan_in;
+    const auto block_size = plan.block_size;
+    const int merges = static_cast<int>(plan.merges.size());
+
+    // files[i] is run i, then the output of merge i - runs
+    std::vector<std::string> files(filenames);
+    files.resize(filenames.size() + merges);
+    // merge reading each file, and inputs each merge is still waiting for
+    std::vector<int> consumer(files.size(), -1);
+    std::vector<int> missing;
+    for (int merge = 0; merge < merges; merge++) {
+      missing.push_back(static_cast<int>(plan.merges[merge].size()));
+      for (auto input : plan.merges[merge])
+        consumer[input] = merge;
+    }
+
+    // the buffers of the sort are used by the first merge slot
+    const auto slot_memory = (fan_in + 1) * block_size;
+    const auto blocks_memory = merge_memory(fan_in, block_size);
+    auto spare = budget.available();
+    spare = spare > blocks_memory ? spare - blocks_memory : 0;
+    const int slots = 1 + static_cast<int>(std::min<unsigned long>(
+                              std::max(workers, 1) - 1,
+                              spare / (slot_memory + blocks_memory)));
+
+    std::vector<std::vector<io_buffer> *> slot_buffers = {&buffers};
+    std::vector<std::vector<io_buffer>> extra_buffers;
+    std::vector<MemoryReservation> extra_reservations;
+    extra_buffers.reserve(slots - 1);
+    for (int i = 1; i < slots; i++) {
+      extra_reservations.emplace_back(budget, slot_memory,
+                                      "merge I/O buffers");
+      extra_buffers.push_back(init_buffers(fan_in, block_size));
+      slot_buffers.push_back(&extra_buffers.back());
+    }
+    std::vector<int> free_slots;
+    for (int i = 0; i < slots; i++)
+      free_slots.push_back(i);
+
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    std::mutex files_mutex;
+    int running = 0;
+    bool done = false;
+    bool stopped = false;
+    std::exception_ptr error;
+    std::vector<std::unique_ptr<TC>> time_controls;
+
+    ParallelWorkerPool pool(slots);
+
+    std::function<void(int)> enqueue;
+    // stores a merged file and queues the merge waiting for it once ready
+    auto place = [&](int file, std::string filename) {
+      files[file] = std::move(filename);
+      auto merge = consumer[file];
+      if (merge < 0)
+        done = true;
+      else if (--missing[merge] == 0)
+        enqueue(merge);
+    };
+
+    enqueue = [&](int merge) {
+      running++;
+      time_controls.push_back(std::make_unique<TC>(time_control));
+      auto *tc_raw_ptr = time_controls.back().get();
+      pool.add_task([&, merge, tc_raw_ptr]() {
+        const bool final_merge = merge == merges - 1;
+        std::vector<int> task_slots;
+        std::vector<std::string> inputs;
+        {
+          std::lock_guard<std::mutex> lg(mutex);
+          if (stopped) {
+            running--;
+            finished_cv.notify_all();
+            return;
+          }
+          // the final merge runs alone, so it takes every slot when its
+          // inputs can be cut in ranges
+          do {
+            task_slots.push_back(free_slots.back());
+            free_slots.pop_back();
+          } while (final_merge && !output.consumer && format == RAW_RUNS &&
+                   io_raw_records<IOHandler>::value && !free_slots.empty());
+          for (auto input : plan.merges[merge])
+            inputs.push_back(files[input]);
+        }
+        auto task_comparator = comparator;
+        MergeOutput destination{"", nullptr};
+        bool completed = false;
+        std::exception_ptr merge_error;
+        try {
+          destination =
+              final_merge
+                  ? output
+                  : MergeOutput{create_merge_file(placement.merge_dir(inputs)),
+                                nullptr, format};
+          if (!destination.consumer) {
+            std::lock_guard<std::mutex> lg(files_mutex);
+            active_files.insert(destination.filename);
+          }
+          if (task_slots.size() > 1) {
+            std::vector<std::vector<io_buffer> *> part_buffers;
+            for (auto slot : task_slots)
+              part_buffers.push_back(slot_buffers[slot]);
+            completed = parallel_merge_pass(
+                inputs, destination.filename, placement, block_size,
+                part_buffers, budget, remove_duplicates, task_comparator,
+                *tc_raw_ptr, active_files, files_mutex);
+          } else {
+            completed = merge_pass(inputs, destination, block_size,
+                                   *slot_buffers[task_slots[0]], budget,
+                                   remove_duplicates, task_comparator,
+                                   *tc_raw_ptr, active_files, files_mutex,
+                                   format);
+          }
+        } catch (...) {
+          merge_error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lg(mutex);
+        free_slots.insert(free_slots.end(), task_slots.begin(),
+                          task_slots.end());
+        running--;
+        if (merge_error && !error)
+          error = merge_error;
+        if (!completed)
+          stopped = true;
+        else if (!stopped)
+          place(static_cast<int>(filenames.size()) + merge,
+                std::move(destination.filename));
+        finished_cv.notify_all();
+      });
+    };
+
+    {
+      std::unique_lock<std::mutex> ul(mutex);
+      for (int merge = 0; merge < merges; merge++) {
+        for (auto input : plan.merges[merge])
+          if (input < static_cast<int>(filenames.size()))
+            missing[merge]--;
+        if (missing[merge] == 0)
+          enqueue(merge);
+      }
+      finished_cv.wait(ul, [&]() { return (done || stopped) && running == 0; });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+
+    if (error)
+      std::rethrow_exception(error);
+    if constexpr (TC::with_time_control)
+      for (auto &tc_ptr : time_controls)
+        if (!tc_ptr->tick())
+          return false;
+    return !stopped;
   }
 
-  static std::vector<std::vector<char>> init_buffers(int max_files,
-                                                     unsigned long block_size) {
-    std::vector<std::vector<char>> buffers;
+  static std::vector<io_buffer> init_buffers(int max_files,
+                                             unsigned long block_size) {
+    std::vector<io_buffer> buffers;
     buffers.reserve(max_files + 1);
     for (int i = 0; i < max_files + 1; i++) {
       buffers.emplace_back(block_size);
@@ -0,0 +1,84 @@
+#ifndef _ES_FILE_DESCRIPTOR_HPP_
+#define _ES_FILE_DESCRIPTOR_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+namespace ExternalSort {
+
+#if defined(__GLIBCXX__)
+// Descriptor of the file opened by a libstdc++ filebuf, -1 when closed
+inline int filebuf_fd(std::filebuf &buffer) {
+  struct file_access : std::filebuf {
+    static int fd(std::filebuf &buffer) {
+      return (buffer.*(&file_access::_M_file)).fd();
+    }
+  };
+  // a closed filebuf has no FILE to take the descriptor of
+  if (!buffer.is_open())
+    return -1;
+  return file_access::fd(buffer);
+}
+#else
+inline int filebuf_fd(std::filebuf &) { return -1; }
+#endif
+
+// Own duplicate of a descriptor, it stays valid after the stream closes its
+inline int duplicate_fd(int fd) {
+  int duplicate = dup(fd);
+  if (duplicate < 0)
+    throw std::runtime_error("couldn't duplicate file descriptor");
+  return duplicate;
+}
+
+/*
+ * Copies length bytes of in, from in_offset, to out at out_offset. The copy
+ * stays in the kernel with copy_file_range, which may share the blocks
+ * instead of copying them, and falls back to pread and pwrite when the file
+ * systems don't support it.
+ */
+inline void copy_file_bytes(int in, unsigned long in_offset, int out,
+                            unsigned long out_offset, unsigned long length) {
+  auto in_position = static_cast<off_t>(in_offset);
+  auto out_position = static_cast<off_t>(out_offset);
+  while (length > 0) {
+    auto copied =
+        copy_file_range(in, &in_position, out, &out_position, length, 0);
+    if (copied < 0 && errno == EINTR)
+      continue;
+    if (copied <= 0)
+      break;
+    length -= static_cast<unsigned long>(copied);
+  }
+  std::vector<char> buffer(length > 0 ? 1UL << 20 : 0);
+  while (length > 0) {
+    auto chunk = std::min<unsigned long>(length, buffer.size());
+    auto bytes = pread(in, buffer.data(), chunk, in_position);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      throw std::runtime_error("couldn't read the file being copied");
+    for (long written = 0; written < bytes;) {
+      auto done = pwrite(out, buffer.data() + written,
+                         static_cast<unsigned long>(bytes - written),
+                         out_position + written);
+      if (done < 0 && errno == EINTR)
+        continue;
+      if (done <= 0)
+        throw std::runtime_error("couldn't write the copied file");
+      written += done;
+    }
+    in_position += bytes;
+    out_position += bytes;
+    length -= static_cast<unsigned long>(bytes);
+  }
+}
+
+} // namespace ExternalSort
+
+#endif /* _ES_FILE_DESCRIPTOR_HPP_ */
@@ -0,0 +1,112 @@
+#ifndef _ES_FRONT_CODED_RUN_HPP_
+#define _ES_FRONT_CODED_RUN_HPP_
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace ExternalSort {
+
+/*
+ * Connectors whose value is nothing but a line, exposed with data() and
+ * size(). Their runs can be stored front coded.
+ */
+template <typename T, typename = void>
+struct front_codes_runs : std::false_type {};
+
+template <typename T>
+struct front_codes_runs<
+    T, std::enable_if_t<T::line_only &&
+                        std::is_convertible_v<
+                            decltype(std::declval<const T &>().data()),
+                            const char *> &&
+                        std::is_integral_v<
+                            decltype(std::declval<const T &>().size())>>>
+    : std::true_type {};
+
+/*
+ * Run of sorted lines where each line is stored as the length of the prefix
+ * it shares with the line before, then the length and the bytes of the rest,
+ * both lengths as varints. Every front_coding_restart lines a line is stored
+ * whole, so decoding can start over from any restart point.
+ */
+constexpr unsigned front_coding_restart = 16;
+
+class FrontCodedRunWriter {
+  std::ostream &os;
+  std::string last;
+  unsigned written;
+
+  void write_varint(unsigned long value) {
+    while (value >= 0x80) {
+      os.put(static_cast<char>(value | 0x80));
+      value >>= 7;
+    }
+    os.put(static_cast<char>(value));
+  }
+
+public:
+  explicit FrontCodedRunWriter(std::ostream &os) : os(os), written(0) {}
+
+  FrontCodedRunWriter(const FrontCodedRunWriter &) = delete;
+  FrontCodedRunWriter &operator=(const FrontCodedRunWriter &) = delete;
+
+  void write_line(const char *line, unsigned long length) {
+    unsigned long shared = 0;
+    if (written++ % front_coding_restart != 0) {
+      auto limit = std::min<unsigned long>(length, last.size());
+      while (shared < limit && last[shared] == line[shared])
+        shared++;
+    }
+    write_varint(shared);
+    write_varint(length - shared);
+    os.write(line + shared, static_cast<std::streamsize>(length - shared));
+    last.resize(shared);
+    last.append(line + shared, length - shared);
+  }
+};
+
+class FrontCodedRunReader {
+  std::istream &is;
+  std::string last;
+
+  bool read_varint(unsigned long &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      auto c = is.get();
+      if (c == std::istream::traits_type::eof())
+        return false;
+      value |= static_cast<unsigned long>(c & 0x7f) << shift;
+      if (!(c & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+public:
+  explicit FrontCodedRunReader(std::istream &is) : is(is) {}
+
+  FrontCodedRunReader(const FrontCodedRunReader &) = delete;
+  FrontCodedRunReader &operator=(const FrontCodedRunReader &) = delete;
+
+  // The next line, valid until the following call, false at the end of the
+  // run
+  bool read_line(const char *&line, unsigned long &length) {
+    unsigned long shared, suffix;
+    if (!read_varint(shared) || !read_varint(suffix) || shared > last.size())
+      return false;
+    last.resize(shared + suffix);
+    if (!is.read(&last[shared], static_cast<std::streamsize>(suffix)))
+      return false;
+    line = last.data();
+    length = last.size();
+    return true;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_FRONT_CODED_RUN_HPP_ */
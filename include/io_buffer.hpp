@@ -0,0 +1,53 @@
+#ifndef _ES_IO_BUFFER_HPP_
+#define _ES_IO_BUFFER_HPP_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace ExternalSort {
+
+// Alignment of file buffers, enough for O_DIRECT on the usual block devices
+constexpr unsigned long io_buffer_alignment = 4096;
+
+// Allocator of memory aligned to Alignment bytes
+template <typename T, std::size_t Alignment> class AlignedAllocator {
+public:
+  using value_type = T;
+
+  template <typename U> struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+  }
+
+  void deallocate(T *pointer, std::size_t) {
+    ::operator delete(pointer, std::align_val_t(Alignment));
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Alignment> &) const {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment> &) const {
+    return false;
+  }
+};
+
+// Buffer of a run, merge or output file
+using io_buffer =
+    std::vector<char, AlignedAllocator<char, io_buffer_alignment>>;
+
+} // namespace ExternalSort
+
+#endif /* _ES_IO_BUFFER_HPP_ */
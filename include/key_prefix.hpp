@@ -0,0 +1,45 @@
+#ifndef _KEY_PREFIX_HPP_
+#define _KEY_PREFIX_HPP_
+
+#include <algorithm>
+#include <cstring>
+
+namespace ExternalSort {
+
+/*
+ * First 8 bytes of a string as a big-endian integer, padded with zeros, so
+ * comparing prefixes as integers gives the byte order of the strings.
+ */
+inline unsigned long string_key_prefix(const char *bytes,
+                                       unsigned long length) {
+  unsigned char buffer[sizeof(unsigned long)] = {0};
+  if (length > 0)
+    std::memcpy(buffer, bytes, std::min(length, sizeof(unsigned long)));
+  unsigned long prefix = 0;
+  for (auto byte : buffer)
+    prefix = (prefix << 8) | byte;
+  return prefix;
+}
+
+// Three-way comparison of two strings given with their key prefixes
+inline int compare_prefixed(unsigned long lhs_prefix, const char *lhs,
+                            unsigned long lhs_length, unsigned long rhs_prefix,
+                            const char *rhs, unsigned long rhs_length) {
+  if (lhs_prefix != rhs_prefix)
+    return lhs_prefix < rhs_prefix ? -1 : 1;
+  auto common = std::min(lhs_length, rhs_length);
+  if (common > sizeof(unsigned long)) {
+    int result = std::memcmp(lhs + sizeof(unsigned long),
+                             rhs + sizeof(unsigned long),
+                             common - sizeof(unsigned long));
+    if (result != 0)
+      return result;
+  }
+  if (lhs_length == rhs_length)
+    return 0;
+  return lhs_length < rhs_length ? -1 : 1;
+}
+
+} // namespace ExternalSort
+
+#endif /* _KEY_PREFIX_HPP_ */
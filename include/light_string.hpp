@@ -6,91 +6,108 @@
 #include <ostream>
 #include <string>
 
+/*
+ * Owning byte string that stores its length. Strings of up to
+ * inline_capacity bytes are kept inside the object, longer ones on the heap.
+ * Comparisons use memcmp, so embedded NUL bytes are preserved.
+ */
 class light_string {
-  char *buf;
+  static constexpr unsigned long inline_capacity = 15;
 
-public:
-  light_string() : buf(nullptr) {}
-  explicit light_string(char *s) {
-    auto size = strlen(s);
-    buf = new char[size + 1]();
-    strcpy(buf, s);
-  }
-  explicit light_string(const std::string &s) {
-    buf = new char[s.size() + 1]();
-    strcpy(buf, s.c_str());
+  unsigned long length;
+  union {
+    char *heap;
+    char local[inline_capacity + 1];
+  };
+
+  bool is_inline() const { return length <= inline_capacity; }
+
+  void assign(const char *s, unsigned long size) {
+    length = size;
+    char *destination = local;
+    if (!is_inline()) {
+      heap = new char[size + 1];
+      destination = heap;
+    }
+    if (size > 0)
+      std::memcpy(destination, s, size);
+    destination[size] = '\0';
   }
 
-  ~light_string() {
-    delete[] buf;
-    buf = nullptr;
+  void steal(light_string &other) {
+    length = other.length;
+    std::memcpy(local, other.local, sizeof(local));
+    other.length = 0;
+    other.local[0] = '\0';
   }
 
-  light_string(const light_string &other) noexcept {
-    auto size = strlen(other.buf);
-    buf = new char[size + 1]();
-    strcpy(buf, other.buf);
+  void release() {
+    if (!is_inline())
+      delete[] heap;
+    length = 0;
+    local[0] = '\0';
   }
 
-  light_string(light_string &&other) noexcept {
-    buf = nullptr;
-    std::swap(buf, other.buf);
+public:
+  light_string() : length(0) { local[0] = '\0'; }
+  explicit light_string(const char *s) { assign(s, std::strlen(s)); }
+  light_string(const char *s, unsigned long size) { assign(s, size); }
+  explicit light_string(const std::string &s) { assign(s.data(), s.size()); }
+
+  ~light_string() { release(); }
+
+  light_string(const light_string &other) {
+    assign(other.data(), other.length);
   }
 
+  light_string(light_string &&other) noexcept { steal(other); }
+
   light_string &operator=(const light_string &other) {
     if (&other != this) {
-      auto size = strlen(other.buf);
-      delete[] buf;
-      buf = new char[size + 1];
-      strcpy(buf, other.buf);
+      release();
+      assign(other.data(), other.length);
     }
     return *this;
   }
 
   light_string &operator=(light_string &&other) noexcept {
-    delete[] buf;
-    buf = nullptr;
-
-    std::swap(buf, other.buf);
+    if (&other != this) {
+      release();
+      steal(other);
+    }
     return *this;
   }
 
+  int compare(const light_string &rhs) const {
+    auto common = std::min(length, rhs.length);
+    int result = common == 0 ? 0 : std::memcmp(data(), rhs.data(), common);
+    if (result != 0 || length == rhs.length)
+      return result;
+    return length < rhs.length ? -1 : 1;
+  }
+
   bool operator==(const light_string &rhs) const {
-    if (!buf)
-      return false;
-    return strcmp(buf, rhs.buf) == 0;
+    return length == rhs.length &&
+           (length == 0 || std::memcmp(data(), rhs.data(), length) == 0);
   }
 
   bool operator!=(const light_string &rhs) const { return !(*this == rhs); }
-  bool operator<(const light_string &rhs) const {
-    if (!buf)
-      return rhs.buf;
-    return strcmp(buf, rhs.buf) < 0;
-  }
-  bool operator>(const light_string &rhs) const { return !(*this < rhs); }
-  bool operator<=(const light_string &rhs) const {
-    if (!buf)
-      return true;
-    return strcmp(buf, rhs.buf) <= 0;
-  }
-  bool operator>=(const light_string &rhs) const {
-    if (!buf)
-      return rhs.buf;
-    return strcmp(buf, rhs.buf) >= 0;
-  }
+  bool operator<(const light_string &rhs) const { return compare(rhs) < 0; }
+  bool operator>(const light_string &rhs) const { return compare(rhs) > 0; }
+  bool operator<=(const light_string &rhs) const { return compare(rhs) <= 0; }
+  bool operator>=(const light_string &rhs) const { return compare(rhs) >= 0; }
 
   friend std::ostream &operator<<(std::ostream &output, const light_string &s) {
-    if (!s.buf)
-      return output;
-    output << s.buf;
+    output.write(s.data(), static_cast<std::streamsize>(s.length));
     return output;
   }
 
-  unsigned long size() const {
-    if (!buf)
-      return 0;
-    return strlen(buf);
-  }
+  const char *data() const { return is_inline() ? local : heap; }
+
+  unsigned long size() const { return length; }
+
+  // Heap bytes owned by the string
+  unsigned long memory_usage() const { return is_inline() ? 0 : length + 1; }
 };
 
-#endif /* _LIGHT_STRING_HPP_H */
\ No newline at end of file
+#endif /* _LIGHT_STRING_HPP_H */
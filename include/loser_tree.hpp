@@ -0,0 +1,86 @@
+#ifndef _ES_LOSER_TREE_HPP_
+#define _ES_LOSER_TREE_HPP_
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace ExternalSort {
+
+/*
+ * Tournament tree over the heads of k sorted sources. Internal nodes keep
+ * the source that lost the match played there and node 0 the overall
+ * winner, so replacing the winner replays a single leaf to root path with
+ * one comparison per level. The tree only stores source indices and
+ * pointers to the head values, which stay where the caller keeps them. An
+ * exhausted source has a null head and loses every match.
+ */
+template <typename T> class LoserTree {
+public:
+  using comp_t = typename T::Comparator;
+
+private:
+  comp_t &comparator;
+  int sources;
+  std::vector<int> tree;
+  std::vector<const T *> heads;
+
+  bool wins(int lhs, int rhs) {
+    if (!heads[lhs])
+      return false;
+    if (!heads[rhs])
+      return true;
+    return comparator(*heads[lhs], *heads[rhs]);
+  }
+
+public:
+  // heads[i] points to the first value of source i, null when it is empty
+  LoserTree(std::vector<const T *> initial_heads, comp_t &comparator)
+      : comparator(comparator),
+        sources(static_cast<int>(initial_heads.size())),
+        tree(std::max(sources, 1), 0), heads(std::move(initial_heads)) {
+    if (sources == 0) {
+      heads.push_back(nullptr);
+      sources = 1;
+      return;
+    }
+    // leaf i is node sources + i, winners[n] is the winner below node n
+    std::vector<int> winners(2 * sources);
+    for (int i = 0; i < sources; i++)
+      winners[sources + i] = i;
+    for (int node = sources - 1; node > 0; node--) {
+      int left = winners[2 * node];
+      int right = winners[2 * node + 1];
+      if (wins(left, right)) {
+        winners[node] = left;
+        tree[node] = right;
+      } else {
+        winners[node] = right;
+        tree[node] = left;
+      }
+    }
+    tree[0] = sources > 1 ? winners[1] : 0;
+  }
+
+  bool empty() const { return !heads[tree[0]]; }
+
+  // Source of the smallest head, only valid when the tree is not empty
+  int winner() const { return tree[0]; }
+
+  const T &top() const { return *heads[tree[0]]; }
+
+  // Sets the head of the winning source, null once it is exhausted
+  void replace_winner(const T *next) {
+    int candidate = tree[0];
+    heads[candidate] = next;
+    for (int node = (sources + candidate) / 2; node > 0; node /= 2) {
+      if (wins(tree[node], candidate))
+        std::swap(tree[node], candidate);
+    }
+    tree[0] = candidate;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_LOSER_TREE_HPP_ */
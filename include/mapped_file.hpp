@@ -0,0 +1,134 @@
+#ifndef _ES_MAPPED_FILE_HPP_
+#define _ES_MAPPED_FILE_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_descriptor.hpp"
+
+namespace ExternalSort {
+
+/*
+ * Sequential reader over a memory mapped window of a file. Values are taken
+ * as pointers into the mapping, so connectors parse them in place instead of
+ * copying them out of a stream. The window slides forward as the file is
+ * read, and grows when a single line doesn't fit in it, so huge files never
+ * need to be mapped whole. A pointer returned stays valid until the next call.
+ */
+class MappedInput {
+  int fd;
+  unsigned long file_size;
+  unsigned long window;
+
+  const char *mapping;
+  unsigned long mapping_offset;
+  unsigned long mapping_length;
+  // file offset of the next byte to take
+  unsigned long position;
+
+  void unmap() {
+    if (mapping)
+      munmap(const_cast<char *>(mapping), mapping_length);
+    mapping = nullptr;
+    mapping_length = 0;
+  }
+
+  // Maps the window around position, holding at least length bytes after it
+  // unless the file ends first
+  void map(unsigned long length) {
+    unmap();
+    static const auto page = static_cast<unsigned long>(sysconf(_SC_PAGESIZE));
+    mapping_offset = position - position % page;
+    mapping_length = std::min(file_size - mapping_offset,
+                              std::max(window, position - mapping_offset +
+                                                   length));
+    if (mapping_length == 0)
+      return;
+    void *address = mmap(nullptr, mapping_length, PROT_READ, MAP_PRIVATE, fd,
+                         static_cast<off_t>(mapping_offset));
+    if (address == MAP_FAILED) {
+      mapping_length = 0;
+      throw std::runtime_error("couldn't map file");
+    }
+    madvise(address, mapping_length, MADV_SEQUENTIAL);
+    mapping = static_cast<const char *>(address);
+  }
+
+  // Bytes mapped after position
+  unsigned long available() const {
+    return mapping ? mapping_offset + mapping_length - position : 0;
+  }
+
+  const char *cursor() const { return mapping + (position - mapping_offset); }
+
+public:
+  // Reads the file of fd from position on, mapping window bytes at a time
+  MappedInput(int file, unsigned long position, unsigned long window)
+      : fd(duplicate_fd(file)), file_size(0), window(std::max(window, 1UL)),
+        mapping(nullptr), mapping_offset(0), mapping_length(0),
+        position(position) {
+    struct stat file_stat {};
+    if (fstat(fd, &file_stat) == 0)
+      file_size = static_cast<unsigned long>(file_stat.st_size);
+    this->position = std::min(position, file_size);
+  }
+
+  MappedInput(const MappedInput &) = delete;
+  MappedInput &operator=(const MappedInput &) = delete;
+
+  ~MappedInput() {
+    unmap();
+    close(fd);
+  }
+
+  // The next length bytes, null when fewer are left
+  const char *take(unsigned long length) {
+    if (file_size - position < length)
+      return nullptr;
+    if (available() < length)
+      map(length);
+    auto *data = cursor();
+    position += length;
+    return data;
+  }
+
+  // The next line without its newline, false at the end of the file
+  bool take_line(const char *&line, unsigned long &length) {
+    if (position >= file_size)
+      return false;
+    // bytes after position known not to hold a newline
+    unsigned long scanned = 0;
+    while (true) {
+      auto mapped = available();
+      if (mapped > scanned) {
+        auto *start = cursor();
+        auto *newline = static_cast<const char *>(
+            std::memchr(start + scanned, '\n', mapped - scanned));
+        if (newline) {
+          line = start;
+          length = static_cast<unsigned long>(newline - start);
+          position += length + 1;
+          return true;
+        }
+        scanned = mapped;
+      }
+      // the last line of the file has no newline
+      if (position + scanned >= file_size) {
+        line = cursor();
+        length = scanned;
+        position += scanned;
+        return true;
+      }
+      map(scanned + window);
+    }
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_MAPPED_FILE_HPP_ */
@@ -0,0 +1,102 @@
+#ifndef _MEMORY_BUDGET_HPP_
+#define _MEMORY_BUDGET_HPP_
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+namespace ExternalSort {
+
+/*
+ * Bytes of memory granted to a sort. Buffers and runs reserve their size
+ * before they are used and release it once they are freed, so the budget
+ * knows how much is in use at any time and its high-water mark. Reserving
+ * more than what is left throws, the memory bounds used to build runs come
+ * from available().
+ */
+class MemoryBudget {
+  const unsigned long limit_bytes;
+  std::atomic<unsigned long> used_bytes;
+  std::atomic<unsigned long> peak_bytes;
+
+public:
+  explicit MemoryBudget(unsigned long limit_bytes)
+      : limit_bytes(limit_bytes), used_bytes(0), peak_bytes(0) {}
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  void reserve(unsigned long bytes, const char *purpose) {
+    auto used = used_bytes.load();
+    do {
+      if (bytes > limit_bytes - used)
+        throw std::runtime_error(
+            std::string("memory budget exceeded reserving ") +
+            std::to_string(bytes) + " bytes for " + purpose + ", " +
+            std::to_string(limit_bytes - used) + " bytes left of " +
+            std::to_string(limit_bytes));
+    } while (!used_bytes.compare_exchange_weak(used, used + bytes));
+
+    auto peak = peak_bytes.load();
+    while (used + bytes > peak &&
+           !peak_bytes.compare_exchange_weak(peak, used + bytes)) {
+    }
+  }
+
+  void release(unsigned long bytes) { used_bytes -= bytes; }
+
+  unsigned long limit() const { return limit_bytes; }
+  unsigned long used() const { return used_bytes.load(); }
+  unsigned long available() const { return limit_bytes - used_bytes.load(); }
+  unsigned long peak() const { return peak_bytes.load(); }
+};
+
+// Reservation released when it goes out of scope
+class MemoryReservation {
+  MemoryBudget *budget;
+  unsigned long bytes;
+
+public:
+  MemoryReservation() : budget(nullptr), bytes(0) {}
+
+  MemoryReservation(MemoryBudget &budget, unsigned long bytes,
+                    const char *purpose)
+      : budget(&budget), bytes(bytes) {
+    budget.reserve(bytes, purpose);
+  }
+
+  MemoryReservation(MemoryReservation &&other) noexcept
+      : budget(other.budget), bytes(other.bytes) {
+    other.budget = nullptr;
+    other.bytes = 0;
+  }
+
+  MemoryReservation &operator=(MemoryReservation &&other) noexcept {
+    if (&other != this) {
+      reset();
+      budget = other.budget;
+      bytes = other.bytes;
+      other.budget = nullptr;
+      other.bytes = 0;
+    }
+    return *this;
+  }
+
+  MemoryReservation(const MemoryReservation &) = delete;
+  MemoryReservation &operator=(const MemoryReservation &) = delete;
+
+  ~MemoryReservation() { reset(); }
+
+  void reset() {
+    if (budget)
+      budget->release(bytes);
+    budget = nullptr;
+    bytes = 0;
+  }
+
+  unsigned long size() const { return bytes; }
+};
+
+} // namespace ExternalSort
+
+#endif /* _MEMORY_BUDGET_HPP_ */
@@ -0,0 +1,136 @@
+#ifndef _ES_MULTIWAY_MERGE_HPP_
+#define _ES_MULTIWAY_MERGE_HPP_
+
+#include <algorithm>
+#include <vector>
+
+#include "ParallelWorker.hpp"
+
+namespace ExternalSort {
+
+template <typename T> class MultiwayMerge {
+public:
+  using comp_t = typename T::Comparator;
+
+  /*
+   * Merges the sorted segments [offsets[i], offsets[i + 1]) of data into out,
+   * which must already hold data.size() elements. The output is cut in
+   * disjoint ranges by splitters sampled from every segment and each worker
+   * moves its key range of all the segments into its own slice of out.
+   */
+  static void merge(std::vector<T> &data, const std::vector<int> &offsets,
+                    std::vector<T> &out, int workers, comp_t &comparator) {
+    int segments = static_cast<int>(offsets.size()) - 1;
+    if (segments <= 0)
+      return;
+
+    auto splitters = select_splitters(data, offsets, workers, comparator);
+    int parts = static_cast<int>(splitters.size()) + 1;
+
+    // bounds[p][i] is where part p starts inside segment i
+    std::vector<std::vector<int>> bounds(parts + 1, std::vector<int>(segments));
+    for (int i = 0; i < segments; i++) {
+      bounds[0][i] = offsets[i];
+      bounds[parts][i] = offsets[i + 1];
+      for (int p = 1; p < parts; p++) {
+        const T &splitter = data[splitters[p - 1]];
+        auto it = std::lower_bound(data.begin() + bounds[p - 1][i],
+                                   data.begin() + offsets[i + 1], splitter,
+                                   comparator);
+        bounds[p][i] = static_cast<int>(it - data.begin());
+      }
+    }
+
+    std::vector<int> out_offsets(parts, 0);
+    for (int p = 1; p < parts; p++) {
+      out_offsets[p] = out_offsets[p - 1];
+      for (int i = 0; i < segments; i++)
+        out_offsets[p] += bounds[p][i] - bounds[p - 1][i];
+    }
+
+    if (parts == 1) {
+      merge_part(data, bounds[0], bounds[1], out, 0, comparator);
+      return;
+    }
+
+    ParallelWorkerPool pool(parts);
+    for (int p = 0; p < parts; p++) {
+      pool.add_task([p, &data, &bounds, &out, &out_offsets, &comparator]() {
+        merge_part(data, bounds[p], bounds[p + 1], out, out_offsets[p],
+                   comparator);
+      });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+  }
+
+private:
+  static constexpr int oversampling = 16;
+
+  /*
+   * Returns the positions in data of at most workers - 1 splitters, taken as
+   * quantiles of a sample drawn with the same stride from every segment.
+   */
+  static std::vector<int> select_splitters(std::vector<T> &data,
+                                           const std::vector<int> &offsets,
+                                           int workers, comp_t &comparator) {
+    std::vector<int> splitters;
+    if (workers <= 1 || data.empty())
+      return splitters;
+
+    int segments = static_cast<int>(offsets.size()) - 1;
+    long stride = std::max<long>(
+        1, static_cast<long>(data.size()) / (workers * oversampling));
+
+    std::vector<int> sample;
+    for (int i = 0; i < segments; i++) {
+      for (long j = offsets[i] + stride / 2; j < offsets[i + 1]; j += stride)
+        sample.push_back(static_cast<int>(j));
+    }
+    std::sort(sample.begin(), sample.end(), [&](int lhs, int rhs) {
+      return comparator(data[lhs], data[rhs]);
+    });
+
+    for (int p = 1; p < workers; p++) {
+      auto index = sample.size() * p / workers;
+      if (index >= sample.size())
+        break;
+      // equal splitters would give empty parts
+      if (!splitters.empty() &&
+          !comparator(data[splitters.back()], data[sample[index]]))
+        continue;
+      splitters.push_back(sample[index]);
+    }
+    return splitters;
+  }
+
+  static void merge_part(std::vector<T> &data, const std::vector<int> &starts,
+                         const std::vector<int> &ends, std::vector<T> &out,
+                         int out_offset, comp_t &comparator) {
+    std::vector<int> positions = starts;
+    std::vector<int> heap;
+    for (int i = 0; i < static_cast<int>(positions.size()); i++) {
+      if (positions[i] < ends[i])
+        heap.push_back(i);
+    }
+    auto heap_comp = [&](int lhs, int rhs) {
+      return comparator(data[positions[rhs]], data[positions[lhs]]);
+    };
+    std::make_heap(heap.begin(), heap.end(), heap_comp);
+
+    int current = out_offset;
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), heap_comp);
+      int segment = heap.back();
+      out[current++] = std::move(data[positions[segment]++]);
+      if (positions[segment] < ends[segment])
+        std::push_heap(heap.begin(), heap.end(), heap_comp);
+      else
+        heap.pop_back();
+    }
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_MULTIWAY_MERGE_HPP_ */
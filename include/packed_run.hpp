@@ -0,0 +1,152 @@
+#ifndef _ES_PACKED_RUN_HPP_
+#define _ES_PACKED_RUN_HPP_
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+
+namespace ExternalSort {
+
+/*
+ * Connectors whose value is nothing but its radix key, rebuilt from the key
+ * with T(key). Their runs can be stored packed.
+ */
+template <typename T, typename = void>
+struct packs_runs : std::false_type {};
+
+template <typename T>
+struct packs_runs<T, std::enable_if_t<T::key_only &&
+                                      std::is_constructible_v<
+                                          T, decltype(std::declval<const T &>()
+                                                          .radix_key())>>>
+    : std::true_type {};
+
+/*
+ * Run of sorted 64-bit keys stored in self-delimiting blocks of up to
+ * packed_block_keys keys. A block holds its first key, the number of keys,
+ * and the gaps between consecutive keys bit-packed at the width of the
+ * largest one, so dense keys take a few bits each. Unpacking reads
+ * fixed-width fields with no branch per key. Keys out of order still
+ * round-trip, their gaps wrap around and take the full width.
+ */
+constexpr unsigned packed_block_keys = 128;
+
+struct PackedBlockHeader {
+  std::uint64_t first;
+  std::uint32_t count;
+  std::uint32_t width;
+};
+
+// 64-bit words holding count - 1 gaps of width bits
+inline unsigned packed_words(unsigned count, unsigned width) {
+  return static_cast<unsigned>(
+      ((count > 0 ? count - 1 : 0) * static_cast<unsigned long>(width) + 63) /
+      64);
+}
+
+class PackedRunWriter {
+  std::ostream &os;
+  std::uint64_t keys[packed_block_keys];
+  std::uint64_t words[packed_block_keys];
+  unsigned count;
+
+  void write_block() {
+    std::uint64_t gaps = 0;
+    for (unsigned i = 1; i < count; i++)
+      gaps |= keys[i] - keys[i - 1];
+    unsigned width = gaps == 0 ? 0 : 64 - __builtin_clzll(gaps);
+    auto size = packed_words(count, width);
+    for (unsigned w = 0; w < size; w++)
+      words[w] = 0;
+    for (unsigned i = 1; i < count; i++) {
+      auto gap = keys[i] - keys[i - 1];
+      auto bit = static_cast<unsigned long>(i - 1) * width;
+      auto word = bit / 64;
+      auto shift = bit % 64;
+      words[word] |= gap << shift;
+      if (shift + width > 64)
+        words[word + 1] |= gap >> (64 - shift);
+    }
+    PackedBlockHeader header{keys[0], count, width};
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char *>(words),
+             static_cast<std::streamsize>(size * sizeof(std::uint64_t)));
+    count = 0;
+  }
+
+public:
+  explicit PackedRunWriter(std::ostream &os) : os(os), count(0) {}
+
+  PackedRunWriter(const PackedRunWriter &) = delete;
+  PackedRunWriter &operator=(const PackedRunWriter &) = delete;
+
+  ~PackedRunWriter() { finish(); }
+
+  void write_key(std::uint64_t key) {
+    keys[count++] = key;
+    if (count == packed_block_keys)
+      write_block();
+  }
+
+  // Writes the last block, if it has any key
+  void finish() {
+    if (count > 0)
+      write_block();
+  }
+};
+
+class PackedRunReader {
+  std::istream &is;
+  std::uint64_t keys[packed_block_keys];
+  std::uint64_t words[packed_block_keys];
+  unsigned count;
+  unsigned next;
+
+  bool read_block() {
+    PackedBlockHeader header{};
+    if (!is.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        header.count == 0 || header.count > packed_block_keys ||
+        header.width > 64)
+      return false;
+    auto size = packed_words(header.count, header.width);
+    if (!is.read(reinterpret_cast<char *>(words),
+                 static_cast<std::streamsize>(size * sizeof(std::uint64_t))))
+      return false;
+    const unsigned width = header.width;
+    const std::uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+    words[size] = 0;
+    keys[0] = header.first;
+    for (unsigned i = 1; i < header.count; i++) {
+      auto bit = static_cast<unsigned long>(i - 1) * width;
+      auto word = bit / 64;
+      auto shift = bit % 64;
+      // words[size] keeps this in bounds, the mask drops what doesn't spill
+      auto gap = words[word] >> shift;
+      if (shift != 0)
+        gap |= words[word + 1] << (64 - shift);
+      keys[i] = keys[i - 1] + (gap & mask);
+    }
+    count = header.count;
+    next = 0;
+    return true;
+  }
+
+public:
+  explicit PackedRunReader(std::istream &is) : is(is), count(0), next(0) {}
+
+  PackedRunReader(const PackedRunReader &) = delete;
+  PackedRunReader &operator=(const PackedRunReader &) = delete;
+
+  bool read_key(std::uint64_t &key) {
+    if (next == count && !read_block())
+      return false;
+    key = keys[next++];
+    return true;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_PACKED_RUN_HPP_ */
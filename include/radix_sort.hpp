@@ -0,0 +1,178 @@
+#ifndef _ES_RADIX_SORT_HPP_
+#define _ES_RADIX_SORT_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ParallelWorker.hpp"
+#include "time_control.hpp"
+
+namespace ExternalSort {
+
+/*
+ * A connector opts into radix sorting by defining
+ *   unsigned long radix_key() const
+ * whose unsigned order is the same as the one given by its Comparator.
+ */
+template <typename T, typename = void>
+struct has_radix_key : std::false_type {};
+
+template <typename T>
+struct has_radix_key<
+    T, std::void_t<decltype(std::declval<const T &>().radix_key())>>
+    : std::true_type {};
+
+// Order preserving transforms from signed integers and doubles to radix keys
+
+inline unsigned long signed_to_radix_key(long value) {
+  return static_cast<unsigned long>(value) ^ (1UL << 63);
+}
+
+inline long radix_key_to_signed(unsigned long key) {
+  return static_cast<long>(key ^ (1UL << 63));
+}
+
+inline unsigned long double_to_radix_key(double value) {
+  static_assert(sizeof(double) == sizeof(unsigned long),
+                "double_to_radix_key expects 64 bits doubles");
+  unsigned long bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  // negative numbers have their order reversed, so all their bits are flipped
+  return (bits & (1UL << 63)) ? ~bits : bits | (1UL << 63);
+}
+
+inline double radix_key_to_double(unsigned long key) {
+  unsigned long bits = (key & (1UL << 63)) ? key & ~(1UL << 63) : ~key;
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+template <typename T, typename TC = NoTimeControl> class RadixSort {
+  static constexpr int digit_bits = 8;
+  static constexpr int digits = 8 * sizeof(unsigned long) / digit_bits;
+  static constexpr int buckets = 1 << digit_bits;
+  static constexpr unsigned long parallel_threshold = 1 << 16;
+
+  using histogram_t = std::array<unsigned long, buckets>;
+
+public:
+  static void sort(std::vector<T> &data, int workers) {
+    TC tc;
+    sort(data, workers, tc);
+  }
+
+  /*
+   * LSD radix sort over the bytes of radix_key(). Digits where every key has
+   * the same byte are skipped, which is common for small ids. Each pass
+   * scatters into an auxiliary vector that is swapped with data.
+   */
+  static void sort(std::vector<T> &data, int workers, TC &time_control) {
+    if (data.size() < 2)
+      return;
+    if (data.size() < parallel_threshold)
+      workers = 1;
+    workers = std::max(workers, 1);
+
+    auto chunk_bounds = chunks(data.size(), workers);
+    int used_digits = digits_in_use(data, chunk_bounds);
+
+    std::vector<T> aux(data.size());
+    std::vector<histogram_t> histograms(chunk_bounds.size() - 1);
+
+    for (int digit = 0; digit < digits; digit++) {
+      if (!(used_digits & (1 << digit)))
+        continue;
+      int shift = digit * digit_bits;
+
+      run_chunks(chunk_bounds, [&](int c) {
+        auto &histogram = histograms[c];
+        histogram.fill(0);
+        for (auto i = chunk_bounds[c]; i < chunk_bounds[c + 1]; i++)
+          histogram[(data[i].radix_key() >> shift) & (buckets - 1)]++;
+      });
+
+      // exclusive prefix sums by bucket and then by chunk, which keeps the
+      // scatter stable
+      unsigned long offset = 0;
+      for (int b = 0; b < buckets; b++) {
+        for (auto &histogram : histograms) {
+          auto count = histogram[b];
+          histogram[b] = offset;
+          offset += count;
+        }
+      }
+
+      run_chunks(chunk_bounds, [&](int c) {
+        auto &positions = histograms[c];
+        for (auto i = chunk_bounds[c]; i < chunk_bounds[c + 1]; i++) {
+          auto bucket = (data[i].radix_key() >> shift) & (buckets - 1);
+          aux[positions[bucket]++] = std::move(data[i]);
+        }
+      });
+
+      data.swap(aux);
+
+      if constexpr (TC::with_time_control)
+        if (!time_control.tick())
+          return;
+    }
+  }
+
+private:
+  static std::vector<unsigned long> chunks(unsigned long size, int workers) {
+    std::vector<unsigned long> bounds;
+    for (int c = 0; c <= workers; c++)
+      bounds.push_back(size * c / workers);
+    return bounds;
+  }
+
+  template <typename F>
+  static void run_chunks(const std::vector<unsigned long> &chunk_bounds,
+                         F &&fun) {
+    int workers = static_cast<int>(chunk_bounds.size()) - 1;
+    if (workers == 1) {
+      fun(0);
+      return;
+    }
+    ParallelWorkerPool pool(workers);
+    for (int c = 0; c < workers; c++) {
+      pool.add_task([c, &fun]() { fun(c); });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+  }
+
+  // Bit set of the digits in which at least two keys differ
+  static int digits_in_use(std::vector<T> &data,
+                           const std::vector<unsigned long> &chunk_bounds) {
+    int workers = static_cast<int>(chunk_bounds.size()) - 1;
+    std::vector<unsigned long> differing(workers, 0);
+    const unsigned long first = data[0].radix_key();
+    run_chunks(chunk_bounds, [&](int c) {
+      unsigned long bits = 0;
+      for (auto i = chunk_bounds[c]; i < chunk_bounds[c + 1]; i++)
+        bits |= data[i].radix_key() ^ first;
+      differing[c] = bits;
+    });
+
+    unsigned long bits = 0;
+    for (auto chunk_bits : differing)
+      bits |= chunk_bits;
+
+    int used_digits = 0;
+    for (int digit = 0; digit < digits; digit++) {
+      if ((bits >> (digit * digit_bits)) & (buckets - 1))
+        used_digits |= 1 << digit;
+    }
+    return used_digits;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_RADIX_SORT_HPP_ */
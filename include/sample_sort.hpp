@@ -0,0 +1,232 @@
+#ifndef _ES_SAMPLE_SORT_HPP_
+#define _ES_SAMPLE_SORT_HPP_
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "ParallelWorker.hpp"
+#include "introsort.hpp"
+#include "time_control.hpp"
+
+namespace ExternalSort {
+
+template <typename T, typename TC = NoTimeControl> class SampleSort {
+  static constexpr int oversampling = 16;
+  static constexpr int buckets_per_worker = 4;
+  static constexpr unsigned long parallel_threshold = 1 << 16;
+
+public:
+  using comp_t = typename T::Comparator;
+
+  static void sort(std::vector<T> &data, comp_t &comparator, int workers) {
+    TC tc;
+    sort(data, comparator, workers, tc);
+  }
+
+  /*
+   * In-place sample sort. Splitters sampled from data define buckets, every
+   * element is classified and moved to its bucket in parallel, then the
+   * buckets are sorted independently on the worker pool.
+   * Elements equal to a splitter get a bucket of their own which is left as
+   * is. Apart from data, only one bucket id per element is allocated.
+   */
+  static void sort(std::vector<T> &data, comp_t &comparator, int workers,
+                   TC &time_control) {
+    if (workers <= 1 || data.size() < parallel_threshold) {
+      sort_range(data, comparator, time_control, 0, data.size());
+      return;
+    }
+
+    auto splitters = select_splitters(data, comparator, workers);
+    int buckets = 2 * static_cast<int>(splitters.size()) + 1;
+
+    std::vector<unsigned short> bucket_ids(data.size());
+    auto bucket_bounds =
+        classify(data, splitters, bucket_ids, buckets, workers, comparator);
+    permute(data, bucket_ids, bucket_bounds, workers);
+    bucket_ids = std::vector<unsigned short>();
+
+    if constexpr (TC::with_time_control)
+      if (!time_control.tick())
+        return;
+
+    ParallelWorkerPool pool(workers);
+    std::vector<std::unique_ptr<TC>> time_controls;
+    // odd buckets hold the values equal to a splitter and are already sorted
+    for (int b = 0; b < buckets; b += 2) {
+      if (bucket_bounds[b + 1] - bucket_bounds[b] < 2)
+        continue;
+      time_controls.push_back(std::make_unique<TC>(time_control));
+      auto *tc_raw_ptr = time_controls.back().get();
+      pool.add_task([b, &data, &comparator, &bucket_bounds, tc_raw_ptr]() {
+        sort_range(data, comparator, *tc_raw_ptr, bucket_bounds[b],
+                   bucket_bounds[b + 1]);
+      });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+
+    if constexpr (TC::with_time_control)
+      for (auto &tc_ptr : time_controls)
+        if (!tc_ptr->tick())
+          return;
+  }
+
+private:
+  static void sort_range(std::vector<T> &data, comp_t &comparator,
+                         TC &time_control, unsigned long start,
+                         unsigned long end) {
+    if constexpr (TC::with_time_control) {
+      IntroSort<T, TC>::sort(data, comparator, time_control,
+                             static_cast<int>(start), static_cast<int>(end));
+    } else {
+      std::sort(data.begin() + start, data.begin() + end, comparator);
+    }
+  }
+
+  // Sorted and distinct splitters from a random sample of data
+  static std::vector<T> select_splitters(std::vector<T> &data,
+                                         comp_t &comparator, int workers) {
+    int wanted = workers * buckets_per_worker - 1;
+    std::mt19937_64 generator(data.size());
+    std::uniform_int_distribution<unsigned long> distribution(0,
+                                                              data.size() - 1);
+    std::vector<T> sample;
+    sample.reserve(wanted * oversampling);
+    for (int i = 0; i < wanted * oversampling; i++)
+      sample.push_back(data[distribution(generator)]);
+    std::sort(sample.begin(), sample.end(), comparator);
+
+    std::vector<T> splitters;
+    for (int i = 1; i <= wanted; i++) {
+      auto &candidate = sample[i * oversampling - 1];
+      if (splitters.empty() || comparator(splitters.back(), candidate))
+        splitters.push_back(candidate);
+    }
+    return splitters;
+  }
+
+  /*
+   * Writes the bucket of every element, 2 * j for values between splitters
+   * j - 1 and j and 2 * j + 1 for values equal to splitter j. Returns the
+   * bucket boundaries.
+   */
+  static std::vector<unsigned long>
+  classify(std::vector<T> &data, std::vector<T> &splitters,
+           std::vector<unsigned short> &bucket_ids, int buckets, int workers,
+           comp_t &comparator) {
+    std::vector<std::vector<unsigned long>> counts(
+        workers, std::vector<unsigned long>(buckets, 0));
+
+    ParallelWorkerPool pool(workers);
+    for (int w = 0; w < workers; w++) {
+      pool.add_task([w, workers, &data, &splitters, &bucket_ids, &counts,
+                     &comparator]() {
+        auto local_comparator = comparator;
+        unsigned long start = data.size() * w / workers;
+        unsigned long end = data.size() * (w + 1) / workers;
+        auto &local_counts = counts[w];
+        for (unsigned long i = start; i < end; i++) {
+          auto it = std::upper_bound(splitters.begin(), splitters.end(),
+                                     data[i], local_comparator);
+          int j = static_cast<int>(it - splitters.begin());
+          int bucket = 2 * j;
+          if (j > 0 && !local_comparator(splitters[j - 1], data[i]))
+            bucket = 2 * j - 1;
+          bucket_ids[i] = static_cast<unsigned short>(bucket);
+          local_counts[bucket]++;
+        }
+      });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+
+    std::vector<unsigned long> bounds(buckets + 1, 0);
+    for (int b = 0; b < buckets; b++) {
+      bounds[b + 1] = bounds[b];
+      for (auto &local_counts : counts)
+        bounds[b + 1] += local_counts[b];
+    }
+    return bounds;
+  }
+
+  /*
+   * Moves every element to its bucket. Each bucket is cut in one stripe per
+   * worker and every worker swaps the elements of its stripes into its own
+   * stripe of their bucket. An element whose stripe is full is swapped to the
+   * end of the stripe being scanned. The few elements left misplaced are
+   * then moved by following the permutation cycles.
+   */
+  static void permute(std::vector<T> &data,
+                      std::vector<unsigned short> &bucket_ids,
+                      const std::vector<unsigned long> &bounds, int workers) {
+    int buckets = static_cast<int>(bounds.size()) - 1;
+    // heads[w][b] to tails[w][b] is the unplaced part of a stripe
+    std::vector<std::vector<unsigned long>> heads(workers), tails(workers);
+    for (int w = 0; w < workers; w++) {
+      for (int b = 0; b < buckets; b++) {
+        auto length = bounds[b + 1] - bounds[b];
+        heads[w].push_back(bounds[b] + length * w / workers);
+        tails[w].push_back(bounds[b] + length * (w + 1) / workers);
+      }
+    }
+
+    ParallelWorkerPool pool(workers);
+    for (int w = 0; w < workers; w++) {
+      pool.add_task([w, buckets, &data, &bucket_ids, &heads, &tails]() {
+        auto &head = heads[w];
+        auto &tail = tails[w];
+        for (int b = 0; b < buckets; b++) {
+          while (head[b] < tail[b]) {
+            auto i = head[b];
+            auto target = bucket_ids[i];
+            if (target == b) {
+              head[b]++;
+              continue;
+            }
+            while (head[target] < tail[target] &&
+                   bucket_ids[head[target]] == target)
+              head[target]++;
+            auto j = head[target] < tail[target] ? head[target]++ : --tail[b];
+            std::swap(data[i], data[j]);
+            std::swap(bucket_ids[i], bucket_ids[j]);
+          }
+        }
+      });
+    }
+    pool.stop_all_workers();
+    pool.wait_workers();
+
+    follow_cycles(data, bucket_ids, bounds);
+  }
+
+  // Moves the misplaced elements to their bucket following the permutation
+  // cycles
+  static void follow_cycles(std::vector<T> &data,
+                            std::vector<unsigned short> &bucket_ids,
+                            const std::vector<unsigned long> &bounds) {
+    int buckets = static_cast<int>(bounds.size()) - 1;
+    std::vector<unsigned long> next(bounds.begin(), bounds.end() - 1);
+    for (int b = 0; b < buckets; b++) {
+      while (next[b] < bounds[b + 1]) {
+        auto target = bucket_ids[next[b]];
+        if (target == b) {
+          next[b]++;
+          continue;
+        }
+        // the target bucket holds a misplaced element past these
+        while (bucket_ids[next[target]] == target)
+          next[target]++;
+        std::swap(data[next[b]], data[next[target]]);
+        std::swap(bucket_ids[next[b]], bucket_ids[next[target]]);
+        next[target]++;
+      }
+    }
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_SAMPLE_SORT_HPP_ */
@@ -0,0 +1,98 @@
+#ifndef _ES_SPSC_QUEUE_HPP_
+#define _ES_SPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace ExternalSort {
+
+/*
+ * Bounded queue between one producer and one consumer thread. Pushing and
+ * popping are lock free, the mutex is only taken by a side that has to wait
+ * for the other one, and by the other side to wake it up.
+ */
+template <typename V> class SpscQueue {
+  std::vector<V> slots;
+  std::atomic<std::size_t> head;
+  std::atomic<std::size_t> tail;
+
+  std::atomic<int> waiters;
+  std::mutex mutex;
+  std::condition_variable changed;
+
+  std::size_t next(std::size_t index) const {
+    return index + 1 == slots.size() ? 0 : index + 1;
+  }
+
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load() > 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      changed.notify_all();
+    }
+  }
+
+  template <typename Ready> void await(Ready ready) {
+    if (ready())
+      return;
+    std::unique_lock<std::mutex> lock(mutex);
+    waiters++;
+    // pairs with the fence in wake(), either ready() sees the change or the
+    // other side sees the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    changed.wait(lock, ready);
+    waiters--;
+  }
+
+public:
+  explicit SpscQueue(std::size_t capacity)
+      : slots(capacity + 1), head(0), tail(0), waiters(0) {}
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  // Producer side, false when the queue is full
+  bool try_push(const V &value) {
+    auto index = tail.load(std::memory_order_relaxed);
+    if (next(index) == head.load(std::memory_order_acquire))
+      return false;
+    slots[index] = value;
+    tail.store(next(index), std::memory_order_release);
+    wake();
+    return true;
+  }
+
+  // Consumer side, false when the queue is empty
+  bool try_pop(V &value) {
+    auto index = head.load(std::memory_order_relaxed);
+    if (index == tail.load(std::memory_order_acquire))
+      return false;
+    value = slots[index];
+    head.store(next(index), std::memory_order_release);
+    wake();
+    return true;
+  }
+
+  void push(const V &value) {
+    while (!try_push(value))
+      await([&]() {
+        return next(tail.load(std::memory_order_relaxed)) !=
+               head.load(std::memory_order_acquire);
+      });
+  }
+
+  void pop(V &value) {
+    while (!try_pop(value))
+      await([&]() {
+        return head.load(std::memory_order_relaxed) !=
+               tail.load(std::memory_order_acquire);
+      });
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_SPSC_QUEUE_HPP_ */
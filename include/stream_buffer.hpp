@@ -0,0 +1,29 @@
+#ifndef _ES_STREAM_BUFFER_HPP_
+#define _ES_STREAM_BUFFER_HPP_
+
+#include <ios>
+#include <memory>
+
+namespace ExternalSort {
+
+/*
+ * Makes buffer the stream buffer of stream. It is deleted with the stream,
+ * after the file of the stream was closed, which is why the buffers keep a
+ * descriptor of their own.
+ */
+template <typename Buffer>
+void attach_stream_buffer(std::ios &stream, std::unique_ptr<Buffer> buffer) {
+  static const int slot = std::ios_base::xalloc();
+  stream.pword(slot) = buffer.get();
+  stream.register_callback(
+      [](std::ios_base::event event, std::ios_base &base, int index) {
+        if (event == std::ios_base::erase_event)
+          delete static_cast<Buffer *>(base.pword(index));
+      },
+      slot);
+  stream.rdbuf(buffer.release());
+}
+
+} // namespace ExternalSort
+
+#endif /* _ES_STREAM_BUFFER_HPP_ */
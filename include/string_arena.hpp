@@ -0,0 +1,84 @@
+#ifndef _STRING_ARENA_HPP_
+#define _STRING_ARENA_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Append-only storage for the bytes of a run. Lines are copied one after the
+ * other into large chunks and clear() drops all of them at once, keeping the
+ * chunks around for the next run.
+ */
+class StringArena {
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    unsigned long size;
+  };
+
+  std::vector<Chunk> chunks;
+  unsigned long chunk_size;
+  unsigned long current_chunk;
+  unsigned long used;
+  // sizes of the chunks before current_chunk
+  unsigned long filled_size;
+
+  std::string line;
+
+public:
+  static constexpr unsigned long default_chunk_size = 1UL << 20;
+
+  explicit StringArena(unsigned long chunk_size = default_chunk_size)
+      : chunk_size(chunk_size), current_chunk(0), used(0), filled_size(0) {}
+
+  StringArena(StringArena &&other) noexcept = default;
+  StringArena &operator=(StringArena &&other) noexcept = default;
+
+  const char *append(const char *bytes, unsigned long length) {
+    while (current_chunk < chunks.size() &&
+           used + length > chunks[current_chunk].size) {
+      filled_size += chunks[current_chunk].size;
+      current_chunk++;
+      used = 0;
+    }
+    if (current_chunk == chunks.size()) {
+      auto size = std::max(chunk_size, length);
+      chunks.push_back({std::make_unique<char[]>(size), size});
+      used = 0;
+    }
+    char *destination = chunks[current_chunk].data.get() + used;
+    std::memcpy(destination, bytes, length);
+    used += length;
+    return destination;
+  }
+
+  // Reads the next line of is into the arena, without its newline
+  bool read_line(std::istream &is, const char *&bytes, unsigned long &length) {
+    if (!std::getline(is, line))
+      return false;
+    length = line.size();
+    bytes = append(line.data(), length);
+    return true;
+  }
+
+  void clear() {
+    current_chunk = 0;
+    used = 0;
+    filled_size = 0;
+  }
+
+  // Size of the chunks used by the lines appended since the last clear()
+  unsigned long memory_usage() const {
+    if (current_chunk == chunks.size())
+      return filled_size;
+    return filled_size + chunks[current_chunk].size;
+  }
+
+  // Bytes memory_usage() can grow by when appending a line
+  unsigned long growth_step() const { return chunk_size; }
+};
+
+#endif /* _STRING_ARENA_HPP_ */
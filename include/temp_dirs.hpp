@@ -0,0 +1,111 @@
+#ifndef _ES_TEMP_DIRS_HPP_
+#define _ES_TEMP_DIRS_HPP_
+
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace ExternalSort {
+
+/*
+ * Directories the temporary files of a sort are written to, usually one per
+ * disk. A single directory converts from a string, so callers with one
+ * scratch disk pass it as before.
+ */
+class TempDirs {
+  std::vector<std::string> dirs;
+
+public:
+  TempDirs(const std::string &dir) : dirs{dir} {}
+
+  TempDirs(const char *dir) : dirs{std::string(dir)} {}
+
+  TempDirs(std::vector<std::string> dirs) : dirs(std::move(dirs)) {
+    if (this->dirs.empty())
+      throw std::invalid_argument("at least one tmp dir is needed");
+  }
+
+  std::size_t size() const { return dirs.size(); }
+
+  const std::string &operator[](std::size_t i) const { return dirs[i]; }
+};
+
+/*
+ * Places the temporary files of a sort over its TempDirs. Runs go round
+ * robin over the directories. A merge writes to the directory with the
+ * fewest bytes placed so far among those holding none of its inputs, so it
+ * reads from some disks while writing to another one, and every disk takes
+ * its share of the writes.
+ */
+class TempPlacement {
+  const TempDirs &dirs;
+  // parent path of a file created in each directory
+  std::vector<std::filesystem::path> parents;
+  std::vector<unsigned long> placed_bytes;
+  std::atomic<unsigned long> runs;
+  std::mutex mutex;
+
+  int dir_of(const std::string &filename) const {
+    auto parent = std::filesystem::path(filename).parent_path();
+    for (std::size_t i = 0; i < parents.size(); i++)
+      if (parents[i] == parent)
+        return static_cast<int>(i);
+    return -1;
+  }
+
+public:
+  explicit TempPlacement(const TempDirs &dirs)
+      : dirs(dirs), placed_bytes(dirs.size(), 0), runs(0) {
+    for (std::size_t i = 0; i < dirs.size(); i++)
+      parents.push_back(
+          (std::filesystem::path(dirs[i]) / "file").parent_path());
+  }
+
+  TempPlacement(const TempPlacement &) = delete;
+  TempPlacement &operator=(const TempPlacement &) = delete;
+
+  // Directory of the next run
+  const std::string &run_dir() { return dirs[runs++ % dirs.size()]; }
+
+  // Counts bytes written to the directory of filename
+  void placed(const std::string &filename, unsigned long bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto dir = dir_of(filename);
+    if (dir >= 0)
+      placed_bytes[dir] += bytes;
+  }
+
+  // Directory of the output of a merge of inputs, which counts as placed
+  const std::string &merge_dir(const std::vector<std::string> &inputs) {
+    std::vector<bool> reading(dirs.size(), false);
+    unsigned long bytes = 0;
+    for (auto &input : inputs) {
+      auto dir = dir_of(input);
+      if (dir >= 0)
+        reading[dir] = true;
+      std::error_code error;
+      auto size = std::filesystem::file_size(input, error);
+      if (!error)
+        bytes += static_cast<unsigned long>(size);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    int best = -1;
+    for (int pass = 0; pass < 2 && best < 0; pass++)
+      for (std::size_t i = 0; i < dirs.size(); i++)
+        // the second pass allows directories being read from
+        if ((pass == 1 || !reading[i]) &&
+            (best < 0 || placed_bytes[i] < placed_bytes[best]))
+          best = static_cast<int>(i);
+    placed_bytes[best] += bytes;
+    return dirs[best];
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_TEMP_DIRS_HPP_ */
@@ -0,0 +1,295 @@
+#ifndef _ES_URING_QUEUE_HPP_
+#define _ES_URING_QUEUE_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ExternalSort {
+
+/*
+ * Reads and writes at file offsets through an io_uring instance driven with
+ * raw syscalls. Requests are queued in the submission ring and handed to the
+ * kernel in batches, whenever some thread waits for a completion, so the
+ * requests of many files share a single io_uring_enter. At most depth
+ * requests are in flight. Several threads may queue and wait at once, one of
+ * them reaps the completions for all. When the kernel has no io_uring, or
+ * one without IORING_OP_READ and IORING_OP_WRITE, every request is done on
+ * the spot with pread or pwrite.
+ */
+class UringQueue {
+public:
+  // Outcome of a request, the bytes transferred or -errno
+  struct Request {
+    bool done = true;
+    long result = 0;
+  };
+
+private:
+  int ring_fd;
+  unsigned entries;
+
+  void *sq_ring;
+  std::size_t sq_ring_size;
+  void *cq_ring;
+  std::size_t cq_ring_size;
+  io_uring_sqe *sqes;
+  std::size_t sqes_size;
+
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  io_uring_cqe *cqes;
+
+  // queued but not handed to the kernel, and not completed
+  unsigned to_submit;
+  unsigned in_flight;
+  bool reaping;
+
+  std::mutex mutex;
+  std::condition_variable completed;
+
+  // Returns how many of the queued requests the kernel took
+  unsigned enter(unsigned submit, unsigned min_complete, unsigned flags) {
+    while (true) {
+      auto result = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete,
+                            flags, nullptr, 0);
+      if (result >= 0)
+        return static_cast<unsigned>(result);
+      if (errno != EINTR && errno != EAGAIN)
+        throw std::runtime_error(std::string("io_uring_enter failed: ") +
+                                 std::strerror(errno));
+    }
+  }
+
+  void reap() {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      auto &cqe = cqes[head & *cq_mask];
+      auto *request = reinterpret_cast<Request *>(cqe.user_data);
+      request->result = cqe.res;
+      request->done = true;
+      in_flight--;
+      head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // Blocks for completions until ready holds, one thread at a time enters
+  // the kernel and the others are woken once it reaped
+  template <typename Ready>
+  void wait_until(std::unique_lock<std::mutex> &lock, Ready ready) {
+    reap();
+    while (!ready()) {
+      if (reaping) {
+        completed.wait(lock);
+        continue;
+      }
+      reaping = true;
+      auto submit = to_submit;
+      to_submit = 0;
+      lock.unlock();
+      unsigned submitted = 0;
+      std::exception_ptr error;
+      try {
+        submitted = enter(submit, 1, IORING_ENTER_GETEVENTS);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      to_submit += submit - std::min(submit, submitted);
+      reaping = false;
+      reap();
+      completed.notify_all();
+      if (error)
+        std::rethrow_exception(error);
+    }
+  }
+
+  void queue(int opcode, int fd, const char *buffer, unsigned long length,
+             unsigned long offset, Request &request) {
+    std::unique_lock<std::mutex> lock(mutex);
+    wait_until(lock, [&]() { return in_flight < entries; });
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    auto &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = static_cast<std::uint8_t>(opcode);
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uintptr_t>(buffer);
+    sqe.len = static_cast<std::uint32_t>(length);
+    sqe.off = offset;
+    sqe.user_data = reinterpret_cast<std::uintptr_t>(&request);
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    request.done = false;
+    to_submit++;
+    in_flight++;
+  }
+
+  // Whether the kernel of the ring runs the read and write opcodes
+  bool supports_read_write() {
+    const unsigned ops = 256;
+    // io_uring_probe ends with its ops, both are multiples of 8 bytes
+    std::vector<std::uint64_t> storage(
+        (sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)) / 8);
+    auto *probe = reinterpret_cast<io_uring_probe *>(storage.data());
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe,
+                ops) < 0)
+      return false;
+    for (int opcode : {IORING_OP_READ, IORING_OP_WRITE})
+      if (opcode >= probe->ops_len ||
+          !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED))
+        return false;
+    return true;
+  }
+
+  void release_rings() {
+    if (sqes)
+      munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    if (sq_ring)
+      munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+      close(ring_fd);
+    ring_fd = -1;
+  }
+
+public:
+  explicit UringQueue(unsigned depth)
+      : ring_fd(-1), entries(0), sq_ring(nullptr), sq_ring_size(0),
+        cq_ring(nullptr), cq_ring_size(0), sqes(nullptr), sqes_size(0),
+        to_submit(0), in_flight(0), reaping(false) {
+    io_uring_params params{};
+    ring_fd = static_cast<int>(
+        syscall(__NR_io_uring_setup, std::max(depth, 1U), &params));
+    if (ring_fd < 0)
+      return;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    auto map = [&](std::size_t size, unsigned long long offset) -> void * {
+      auto *address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+      return address == MAP_FAILED ? nullptr : address;
+    };
+    sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+    if (!sq_ring || !cq_ring || !sqes) {
+      release_rings();
+      return;
+    }
+
+    auto *sq = static_cast<char *>(sq_ring);
+    auto *cq = static_cast<char *>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    entries = params.sq_entries;
+
+    if (!supports_read_write())
+      release_rings();
+  }
+
+  UringQueue(const UringQueue &) = delete;
+  UringQueue &operator=(const UringQueue &) = delete;
+
+  ~UringQueue() {
+    if (ring_fd >= 0) {
+      std::unique_lock<std::mutex> lock(mutex);
+      wait_until(lock, [&]() { return in_flight == 0; });
+    }
+    release_rings();
+  }
+
+  bool uses_uring() const { return ring_fd >= 0; }
+
+  void read(int fd, char *buffer, unsigned long length, unsigned long offset,
+            Request &request) {
+    if (ring_fd >= 0) {
+      queue(IORING_OP_READ, fd, buffer, length, offset, request);
+      return;
+    }
+    unsigned long total = 0;
+    while (total < length) {
+      auto bytes = pread(fd, buffer + total, length - total,
+                         static_cast<off_t>(offset + total));
+      if (bytes < 0 && errno == EINTR)
+        continue;
+      if (bytes < 0) {
+        request.result = -errno;
+        return;
+      }
+      if (bytes == 0)
+        break;
+      total += bytes;
+    }
+    request.result = static_cast<long>(total);
+  }
+
+  void write(int fd, const char *buffer, unsigned long length,
+             unsigned long offset, Request &request) {
+    if (ring_fd >= 0) {
+      queue(IORING_OP_WRITE, fd, buffer, length, offset, request);
+      return;
+    }
+    unsigned long total = 0;
+    while (total < length) {
+      auto bytes = pwrite(fd, buffer + total, length - total,
+                          static_cast<off_t>(offset + total));
+      if (bytes < 0 && errno == EINTR)
+        continue;
+      if (bytes < 0) {
+        request.result = -errno;
+        return;
+      }
+      total += bytes;
+    }
+    request.result = static_cast<long>(total);
+  }
+
+  // Submits the queued requests and waits for this one, returns its result
+  long wait(Request &request) {
+    if (ring_fd < 0)
+      return request.result;
+    std::unique_lock<std::mutex> lock(mutex);
+    if (to_submit > 0 && !reaping)
+      to_submit -= std::min(to_submit, enter(to_submit, 0, 0));
+    wait_until(lock, [&]() { return request.done; });
+    return request.result;
+  }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_URING_QUEUE_HPP_ */
@@ -0,0 +1,367 @@
+#ifndef _ES_URING_STREAMBUF_HPP_
+#define _ES_URING_STREAMBUF_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <ios>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_descriptor.hpp"
+#include "io_buffer.hpp"
+#include "stream_buffer.hpp"
+#include "uring_queue.hpp"
+
+namespace ExternalSort {
+
+// Descriptor of the file of fd that bypasses the page cache, -1 when the
+// file system doesn't take O_DIRECT
+inline int reopen_direct(int fd, int flags) {
+  auto path = "/proc/self/fd/" + std::to_string(fd);
+  return open(path.c_str(), flags | O_DIRECT | O_CLOEXEC);
+}
+
+/*
+ * Cuts memory into at most window chunks of the returned size. With a
+ * direct descriptor the chunks are aligned for O_DIRECT, when the memory
+ * can't hold one of them the descriptor is closed and set to -1.
+ */
+template <typename Chunk>
+unsigned long cut_chunks(char *memory, unsigned long size, unsigned window,
+                         int &direct_fd, std::vector<Chunk> &chunks) {
+  unsigned long alignment = 1;
+  if (direct_fd >= 0) {
+    auto address = reinterpret_cast<std::uintptr_t>(memory);
+    if (address % io_buffer_alignment == 0 && size >= io_buffer_alignment) {
+      alignment = io_buffer_alignment;
+    } else {
+      close(direct_fd);
+      direct_fd = -1;
+    }
+  }
+  window = static_cast<unsigned>(
+      std::clamp<unsigned long>(window, 1, size / alignment));
+  auto chunk_size = size / window / alignment * alignment;
+  for (unsigned i = 0; i < window; i++)
+    chunks.push_back(Chunk{memory + i * chunk_size, 0, 0, {}});
+  return chunk_size;
+}
+
+/*
+ * Input buffer of a file read through a UringQueue. The memory given is cut
+ * into window chunks that are read ahead of the position, so parsing a chunk
+ * overlaps the reads of the next ones. Seeking inside the current chunk is
+ * free, anywhere else it drops the chunks in flight. In direct mode the
+ * chunks are read with O_DIRECT from aligned offsets, leaving the page cache
+ * alone. A failed read throws std::ios_base::failure, which sets badbit on
+ * the stream.
+ */
+class UringReadBuf : public std::streambuf {
+  struct Chunk {
+    char *data;
+    unsigned long offset;
+    // bytes read, -1 until the request completed
+    long length;
+    UringQueue::Request request;
+  };
+
+  UringQueue &queue;
+  int fd;
+  int direct_fd;
+  unsigned long chunk_size;
+  std::vector<Chunk> chunks;
+  std::size_t current;
+  // where reading starts when no chunk is loaded
+  unsigned long position;
+  bool loading;
+
+  void request(Chunk &chunk, unsigned long offset) {
+    chunk.offset = offset;
+    chunk.length = -1;
+    queue.read(direct_fd >= 0 ? direct_fd : fd, chunk.data, chunk_size,
+               offset, chunk.request);
+  }
+
+  void drain() {
+    if (!loading)
+      return;
+    for (auto &chunk : chunks)
+      queue.wait(chunk.request);
+    loading = false;
+  }
+
+  // Waits for the chunk, completing reads cut short before the end of file
+  long complete(Chunk &chunk) {
+    if (chunk.length >= 0)
+      return chunk.length;
+    long length = queue.wait(chunk.request);
+    while (length > 0 && static_cast<unsigned long>(length) < chunk_size) {
+      UringQueue::Request rest;
+      queue.read(fd, chunk.data + length, chunk_size - length,
+                 chunk.offset + length, rest);
+      auto more = queue.wait(rest);
+      if (more <= 0) {
+        if (more < 0)
+          length = more;
+        break;
+      }
+      length += more;
+    }
+    if (length < 0) {
+      // the chunk reads as the end of the file if underflow is called again
+      chunk.length = 0;
+      auto error = static_cast<int>(-length);
+      throw std::ios_base::failure(
+          std::string("read failed: ") + std::strerror(error),
+          std::error_code(error, std::generic_category()));
+    }
+    chunk.length = length;
+    return chunk.length;
+  }
+
+  unsigned long tell() const {
+    if (!loading)
+      return position;
+    return chunks[current].offset + (gptr() - eback());
+  }
+
+protected:
+  int_type underflow() override {
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+    unsigned long skip = 0;
+    if (!loading) {
+      // chunks start at multiples of the chunk size, as O_DIRECT wants
+      skip = position % chunk_size;
+      for (std::size_t i = 0; i < chunks.size(); i++)
+        request(chunks[i], position - skip + i * chunk_size);
+      current = 0;
+      loading = true;
+    } else {
+      auto &chunk = chunks[current];
+      // a chunk shorter than the others ends the file
+      if (static_cast<unsigned long>(chunk.length) < chunk_size)
+        return traits_type::eof();
+      request(chunk, chunk.offset + chunks.size() * chunk_size);
+      current = (current + 1) % chunks.size();
+    }
+    auto &chunk = chunks[current];
+    auto length = static_cast<unsigned long>(complete(chunk));
+    setg(chunk.data, chunk.data + std::min(skip, length), chunk.data + length);
+    if (gptr() == egptr())
+      return traits_type::eof();
+    return traits_type::to_int_type(*gptr());
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    if (dir == std::ios_base::cur && off == 0)
+      return pos_type(static_cast<off_type>(tell()));
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+      base = static_cast<off_type>(tell());
+    } else if (dir == std::ios_base::end) {
+      struct stat file_stat {};
+      if (fstat(fd, &file_stat) != 0)
+        return pos_type(off_type(-1));
+      base = file_stat.st_size;
+    }
+    if (base + off < 0)
+      return pos_type(off_type(-1));
+    return seekpos(pos_type(base + off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::in) || off_type(pos) < 0)
+      return pos_type(off_type(-1));
+    auto target = static_cast<unsigned long>(off_type(pos));
+    if (loading) {
+      auto &chunk = chunks[current];
+      if (target >= chunk.offset &&
+          target <= chunk.offset + static_cast<unsigned long>(chunk.length)) {
+        setg(eback(), eback() + (target - chunk.offset), egptr());
+        return pos;
+      }
+      drain();
+    }
+    position = target;
+    setg(nullptr, nullptr, nullptr);
+    return pos;
+  }
+
+public:
+  UringReadBuf(UringQueue &queue, int file, char *memory, unsigned long size,
+               unsigned window, bool direct = false)
+      : queue(queue), fd(duplicate_fd(file)),
+        direct_fd(direct ? reopen_direct(file, O_RDONLY) : -1), current(0),
+        loading(false) {
+    chunk_size = cut_chunks(memory, size, window, direct_fd, chunks);
+    auto offset = lseek(fd, 0, SEEK_CUR);
+    position = offset > 0 ? static_cast<unsigned long>(offset) : 0;
+  }
+
+  UringReadBuf(const UringReadBuf &) = delete;
+  UringReadBuf &operator=(const UringReadBuf &) = delete;
+
+  ~UringReadBuf() override {
+    drain();
+    if (direct_fd >= 0)
+      close(direct_fd);
+    close(fd);
+  }
+
+  bool direct() const { return direct_fd >= 0; }
+};
+
+/*
+ * Output buffer of a file written through a UringQueue. The memory given is
+ * cut into window chunks, every filled chunk is written in the background
+ * while the next ones are filled. Only sync, seeking and the destructor wait
+ * for the writes. In direct mode whole chunks at aligned offsets are written
+ * with O_DIRECT, the unaligned ends of the file go through the page cache.
+ */
+class UringWriteBuf : public std::streambuf {
+  struct Chunk {
+    char *data;
+    unsigned long offset;
+    // bytes being written
+    unsigned long length;
+    UringQueue::Request request;
+  };
+
+  UringQueue &queue;
+  int fd;
+  int direct_fd;
+  unsigned long chunk_size;
+  std::vector<Chunk> chunks;
+  std::size_t current;
+  // file offset of the put area
+  unsigned long position;
+  bool failed;
+
+  // Put area over the current chunk, cut short to end at a chunk boundary
+  void reset_put_area() {
+    auto &chunk = chunks[current];
+    setp(chunk.data, chunk.data + chunk_size - position % chunk_size);
+  }
+
+  // Waits for the write of the chunk, completing writes cut short
+  void complete(Chunk &chunk) {
+    if (chunk.length == 0)
+      return;
+    long written = queue.wait(chunk.request);
+    while (written >= 0 && static_cast<unsigned long>(written) < chunk.length) {
+      UringQueue::Request rest;
+      queue.write(fd, chunk.data + written, chunk.length - written,
+                  chunk.offset + written, rest);
+      auto more = queue.wait(rest);
+      if (more <= 0) {
+        written = -1;
+        break;
+      }
+      written += more;
+    }
+    if (written < 0)
+      failed = true;
+    chunk.length = 0;
+  }
+
+  // Queues the write of the put area and moves it to the next chunk
+  void submit() {
+    auto length = static_cast<unsigned long>(pptr() - pbase());
+    if (length == 0)
+      return;
+    auto &chunk = chunks[current];
+    chunk.offset = position;
+    chunk.length = length;
+    bool aligned = position % chunk_size == 0 && length == chunk_size;
+    queue.write(direct_fd >= 0 && aligned ? direct_fd : fd, chunk.data, length,
+                position, chunk.request);
+    position += length;
+    current = (current + 1) % chunks.size();
+    complete(chunks[current]);
+    reset_put_area();
+  }
+
+  bool drain() {
+    submit();
+    for (auto &chunk : chunks)
+      complete(chunk);
+    return !failed;
+  }
+
+protected:
+  int_type overflow(int_type c) override {
+    submit();
+    if (failed)
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override { return drain() ? 0 : -1; }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    auto here = static_cast<off_type>(position + (pptr() - pbase()));
+    if (dir == std::ios_base::cur && off == 0)
+      return pos_type(here);
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+      base = here;
+    } else if (dir == std::ios_base::end) {
+      struct stat file_stat {};
+      if (!drain() || fstat(fd, &file_stat) != 0)
+        return pos_type(off_type(-1));
+      base = file_stat.st_size;
+    }
+    if (base + off < 0)
+      return pos_type(off_type(-1));
+    return seekpos(pos_type(base + off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::out) || off_type(pos) < 0 || !drain())
+      return pos_type(off_type(-1));
+    position = static_cast<unsigned long>(off_type(pos));
+    reset_put_area();
+    return pos;
+  }
+
+public:
+  UringWriteBuf(UringQueue &queue, int file, char *memory, unsigned long size,
+                unsigned window, bool direct = false)
+      : queue(queue), fd(duplicate_fd(file)),
+        direct_fd(direct ? reopen_direct(file, O_WRONLY) : -1), current(0),
+        failed(false) {
+    chunk_size = cut_chunks(memory, size, window, direct_fd, chunks);
+    auto offset = lseek(fd, 0, SEEK_CUR);
+    position = offset > 0 ? static_cast<unsigned long>(offset) : 0;
+    reset_put_area();
+  }
+
+  UringWriteBuf(const UringWriteBuf &) = delete;
+  UringWriteBuf &operator=(const UringWriteBuf &) = delete;
+
+  ~UringWriteBuf() override {
+    drain();
+    if (direct_fd >= 0)
+      close(direct_fd);
+    close(fd);
+  }
+
+  bool direct() const { return direct_fd >= 0; }
+};
+
+} // namespace ExternalSort
+
+#endif /* _ES_URING_STREAMBUF_HPP_ */
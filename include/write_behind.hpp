@@ -0,0 +1,234 @@
+#ifndef _ES_WRITE_BEHIND_HPP_
+#define _ES_WRITE_BEHIND_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "file_descriptor.hpp"
+#include "io_buffer.hpp"
+#include "spsc_queue.hpp"
+#include "stream_buffer.hpp"
+
+namespace ExternalSort {
+
+/*
+ * Output buffer whose writes are done by a thread of its own. The memory
+ * given is cut into chunks: the stream fills one while the writer thread
+ * writes the others, so the thread producing values only stalls when the
+ * disk is behind by every chunk. Filled chunks and free ones go back and
+ * forth through two lock free queues, and the chunks waiting that continue
+ * each other are written with a single pwritev.
+ */
+class WriteBehindBuf : public std::streambuf {
+  struct Block {
+    // -1 stops the writer
+    int chunk;
+    unsigned long offset;
+    unsigned long length;
+  };
+
+  int fd;
+  unsigned long chunk_size;
+  std::vector<char *> chunks;
+  int current;
+  // file offset of the put area
+  unsigned long position;
+
+  SpscQueue<Block> filled;
+  SpscQueue<int> free_chunks;
+  // chunks handed to the writer and not written yet
+  std::atomic<int> pending;
+  std::atomic<bool> failed;
+  std::mutex written_mutex;
+  std::condition_variable written;
+  std::thread writer;
+
+  bool write_blocks(const std::vector<Block> &batch) {
+    std::vector<iovec> vectors;
+    for (const auto &block : batch)
+      vectors.push_back(iovec{chunks[block.chunk], block.length});
+    auto offset = batch.front().offset;
+    std::size_t first = 0;
+    while (first < vectors.size()) {
+      auto bytes = pwritev(fd, vectors.data() + first,
+                           static_cast<int>(vectors.size() - first),
+                           static_cast<off_t>(offset));
+      if (bytes < 0 && errno == EINTR)
+        continue;
+      if (bytes <= 0)
+        return false;
+      offset += static_cast<unsigned long>(bytes);
+      // skips what was written, resuming a vector cut short
+      auto left = static_cast<unsigned long>(bytes);
+      while (first < vectors.size() && left >= vectors[first].iov_len) {
+        left -= vectors[first].iov_len;
+        first++;
+      }
+      if (first < vectors.size()) {
+        vectors[first].iov_base = static_cast<char *>(vectors[first].iov_base) +
+                                  left;
+        vectors[first].iov_len -= left;
+      }
+    }
+    return true;
+  }
+
+  void release(std::vector<Block> &batch) {
+    if (!failed && !write_blocks(batch))
+      failed = true;
+    for (const auto &block : batch)
+      free_chunks.push(block.chunk);
+    if (pending.fetch_sub(static_cast<int>(batch.size())) ==
+        static_cast<int>(batch.size())) {
+      std::lock_guard<std::mutex> lock(written_mutex);
+      written.notify_all();
+    }
+    batch.clear();
+  }
+
+  void write_loop() {
+    std::vector<Block> batch;
+    Block block{};
+    while (true) {
+      filled.pop(block);
+      // gathers the blocks already waiting
+      while (block.chunk >= 0) {
+        if (!batch.empty() &&
+            batch.back().offset + batch.back().length != block.offset)
+          release(batch);
+        batch.push_back(block);
+        if (!filled.try_pop(block))
+          break;
+      }
+      if (!batch.empty())
+        release(batch);
+      if (block.chunk < 0)
+        return;
+    }
+  }
+
+  // Hands the put area to the writer and moves to a free chunk
+  void submit() {
+    auto length = static_cast<unsigned long>(pptr() - pbase());
+    if (length == 0)
+      return;
+    pending++;
+    filled.push(Block{current, position, length});
+    position += length;
+    free_chunks.pop(current);
+    setp(chunks[current], chunks[current] + chunk_size);
+  }
+
+  bool drain() {
+    submit();
+    std::unique_lock<std::mutex> lock(written_mutex);
+    written.wait(lock, [&]() { return pending == 0; });
+    return !failed;
+  }
+
+protected:
+  int_type overflow(int_type c) override {
+    submit();
+    if (failed)
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override { return drain() ? 0 : -1; }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    auto here = static_cast<off_type>(position + (pptr() - pbase()));
+    if (dir == std::ios_base::cur && off == 0)
+      return pos_type(here);
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+      base = here;
+    } else if (dir == std::ios_base::end) {
+      struct stat file_stat {};
+      if (!drain() || fstat(fd, &file_stat) != 0)
+        return pos_type(off_type(-1));
+      base = file_stat.st_size;
+    }
+    if (base + off < 0)
+      return pos_type(off_type(-1));
+    return seekpos(pos_type(base + off), which);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::out) || off_type(pos) < 0 || !drain())
+      return pos_type(off_type(-1));
+    position = static_cast<unsigned long>(off_type(pos));
+    return pos;
+  }
+
+public:
+  WriteBehindBuf(int file, char *memory, unsigned long size, unsigned count)
+      : fd(duplicate_fd(file)), current(0), filled(count),
+        free_chunks(count), pending(0), failed(false) {
+    count = static_cast<unsigned>(std::clamp<unsigned long>(count, 1, size));
+    chunk_size = size / count;
+    for (unsigned i = 0; i < count; i++) {
+      chunks.push_back(memory + i * chunk_size);
+      if (i > 0)
+        free_chunks.push(static_cast<int>(i));
+    }
+    setp(chunks[0], chunks[0] + chunk_size);
+    auto offset = lseek(fd, 0, SEEK_CUR);
+    position = offset > 0 ? static_cast<unsigned long>(offset) : 0;
+    writer = std::thread([this]() { write_loop(); });
+  }
+
+  WriteBehindBuf(const WriteBehindBuf &) = delete;
+  WriteBehindBuf &operator=(const WriteBehindBuf &) = delete;
+
+  ~WriteBehindBuf() override {
+    drain();
+    filled.push(Block{-1, 0, 0});
+    writer.join();
+    close(fd);
+  }
+};
+
+// Smallest chunk worth a hand off to the writer thread
+constexpr unsigned long write_behind_chunk = 64UL << 10;
+
+/*
+ * Gives ofs a WriteBehindBuf over buffer, cut into up to four chunks of at
+ * least write_behind_chunk bytes. Returns false, leaving the stream alone,
+ * when the stream isn't open, the buffer holds fewer than two chunks or the
+ * file descriptor is unknown.
+ */
+inline bool attach_write_behind(std::ofstream &ofs, io_buffer &buffer) {
+  auto count = std::min(4UL, buffer.size() / write_behind_chunk);
+  if (count < 2 || !ofs.is_open())
+    return false;
+  int fd = filebuf_fd(*ofs.rdbuf());
+  if (fd < 0)
+    return false;
+  attach_stream_buffer(
+      ofs, std::make_unique<WriteBehindBuf>(fd, buffer.data(), buffer.size(),
+                                            static_cast<unsigned>(count)));
+  return true;
+}
+
+} // namespace ExternalSort
+
+#endif /* _ES_WRITE_BEHIND_HPP_ */
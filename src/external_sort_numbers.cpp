@@ -2,7 +2,9 @@
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
 
 #include <UnsignedLongSortConnector.hpp>
 #include <cstdlib>
@@ -12,10 +14,12 @@
 struct parsed_options {
   std::string input_file;
   std::string output_file;
-  std::string tmp_dir;
+  // runs are spread over the directories, one per disk
+  std::vector<std::string> tmp_dirs;
   unsigned long max_memory;
   int workers;
   bool remove_duplicates;
+  ExternalSort::SortOptions sort_options;
 };
 
 parsed_options parse_cmline(int argc, char **argv);
@@ -31,20 +35,31 @@ int main(int argc, char **argv) {
   std::cout << "given options:\n"
             << "workers: " << parsed.workers << "\n"
             << "max-memory: " << parsed.max_memory << "\n"
-            << "tmp-dir: " << parsed.tmp_dir << std::endl;
+            << "tmp-dirs: " << parsed.tmp_dirs.size() << "\n"
+            << "run-generation: " << parsed.sort_options.run_generation << "\n"
+            << "sort-engine: " << parsed.sort_options.sort_engine << std::endl;
 
   auto binary_converted_name = parsed.input_file + ".binary";
   auto binary_out_converted_name = parsed.output_file + ".binary";
 
   transform_to_binary(parsed.input_file, binary_converted_name);
 
-  ExternalSort::ExternalSort<
+  auto report = ExternalSort::ExternalSort<
       ExternalSort::UnsignedLongSortConnector,
       ExternalSort::DATA_MODE::BINARY>::sort(binary_converted_name,
                                              binary_out_converted_name,
-                                             parsed.tmp_dir, parsed.workers, 10,
-                                             parsed.max_memory, 4096,
-                                             parsed.remove_duplicates);
+                                             parsed.tmp_dirs, parsed.workers,
+                                             256, parsed.max_memory, 4096,
+                                             parsed.remove_duplicates,
+                                             parsed.sort_options);
+  std::cout << "runs: " << report.runs << "\n"
+            << "memory-peak: " << report.memory_peak << "\n"
+            << "peak-rss: " << report.peak_rss << "\n"
+            << "merge-fan-in: " << report.merge_fan_in << "\n"
+            << "merge-block-size: " << report.merge_block_size << "\n"
+            << "merges: " << report.merges << "\n"
+            << "merge-bytes: " << report.merge_bytes << "\n"
+            << "concatenated-runs: " << report.concatenated_runs << std::endl;
 
   std::filesystem::remove(std::filesystem::path(binary_converted_name));
 
@@ -79,7 +94,7 @@ void transform_to_binary(const std::string &input_fname,
 }
 
 parsed_options parse_cmline(int argc, char **argv) {
-  const char short_options[] = "i:o:t::m::w::u::";
+  const char short_options[] = "i:o:t::m::w::u::r::e::";
   struct option long_options[] = {
       {"input-file", required_argument, nullptr, 'i'},
       {"output-file", required_argument, nullptr, 'o'},
@@ -87,6 +102,8 @@ parsed_options parse_cmline(int argc, char **argv) {
       {"max-memory", optional_argument, nullptr, 'm'},
       {"workers", optional_argument, nullptr, 'w'},
       {"unique-values", optional_argument, nullptr, 'u'},
+      {"run-generation", optional_argument, nullptr, 'r'},
+      {"sort-engine", optional_argument, nullptr, 'e'},
   };
 
   int opt, opt_index;
@@ -97,6 +114,12 @@ parsed_options parse_cmline(int argc, char **argv) {
   bool has_max_mem = false;
   bool has_workers = false;
   parsed_options out{};
+  // fan-in and merge block size are planned from the memory budget
+  out.sort_options.merge_sizing = ExternalSort::BUDGET_FAN_IN;
+  // the numbers are sorted as plain keys, their runs are stored packed
+  out.sort_options.run_format = ExternalSort::PACKED_RUNS;
+  // runs of near sorted inputs are appended instead of merged
+  out.sort_options.disjoint_runs = ExternalSort::CONCATENATE_DISJOINT;
 
   while ((
       opt = getopt_long(argc, argv, short_options, long_options, &opt_index))) {
@@ -114,8 +137,13 @@ parsed_options parse_cmline(int argc, char **argv) {
       break;
     case 't':
       if (optarg) {
-        out.tmp_dir = optarg;
-        has_tmp_dir = true;
+        // a comma separated list of directories
+        std::stringstream dirs(optarg);
+        std::string dir;
+        while (std::getline(dirs, dir, ','))
+          if (!dir.empty())
+            out.tmp_dirs.push_back(dir);
+        has_tmp_dir = !out.tmp_dirs.empty();
       }
       break;
     case 'm':
@@ -133,6 +161,35 @@ parsed_options parse_cmline(int argc, char **argv) {
     case 'u':
       out.remove_duplicates = true;
       break;
+    case 'r':
+      if (optarg) {
+        std::string run_generation(optarg);
+        if (run_generation == "double-buffered")
+          out.sort_options.run_generation = ExternalSort::DOUBLE_BUFFERED;
+        else if (run_generation == "replacement-selection")
+          out.sort_options.run_generation =
+              ExternalSort::REPLACEMENT_SELECTION;
+        else if (run_generation == "parallel-ranges")
+          out.sort_options.run_generation = ExternalSort::PARALLEL_RANGES;
+        else if (run_generation == "load-sort-spill")
+          out.sort_options.run_generation = ExternalSort::LOAD_SORT_SPILL;
+        else
+          throw std::runtime_error("unknown run-generation (r) value: " +
+                                   run_generation);
+      }
+      break;
+    case 'e':
+      if (optarg) {
+        std::string sort_engine(optarg);
+        if (sort_engine == "sample-sort")
+          out.sort_options.sort_engine = ExternalSort::SAMPLE_SORT;
+        else if (sort_engine == "segment-merge")
+          out.sort_options.sort_engine = ExternalSort::SEGMENT_MERGE;
+        else
+          throw std::runtime_error("unknown sort-engine (e) value: " +
+                                   sort_engine);
+      }
+      break;
     default:
       break;
     }
@@ -155,7 +212,7 @@ parsed_options parse_cmline(int argc, char **argv) {
     char *tmp_dir = mkdtemp(mut_fname_template.get());
     if (!tmp_dir)
       throw std::runtime_error("Couldn't generate tmp dir");
-    out.tmp_dir = tmp_dir;
+    out.tmp_dirs.push_back(tmp_dir);
   }
 
   if (!has_max_mem) {
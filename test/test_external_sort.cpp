@@ -3,10 +3,15 @@
 #include <chrono>
 #include <cmath>
 #include <external_sort.hpp>
+#include <filesystem>
+#include <random>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include <ESTimeControl.hpp>
 #include <LightStringSortConnector.hpp>
+#include <PrefixStringSortConnector.hpp>
 
 using namespace std::chrono_literals;
 
@@ -80,4 +85,545 @@ TEST(a, b) {
                                                                      begin)
                    .count()
             << "[ms]" << std::endl;
-}
\ No newline at end of file
+}
+
+static void write_reversed_padded_lines(const std::string &file_name,
+                                        int max_value) {
+  std::ofstream ofs(file_name, std::ios::out);
+  for (int i = max_value; i >= 0; i--) {
+    ofs << transform_int_to_str_padded(i, 9) << '\n';
+  }
+}
+
+static void assert_padded_lines_sorted(const std::string &file_name,
+                                       int max_value) {
+  std::ifstream ifs(file_name, std::ios::in);
+  std::string line;
+  int i = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_EQ(line, transform_int_to_str_padded(i, 9)) << "failed at i = " << i;
+    i++;
+  }
+  ASSERT_EQ(i, max_value + 1);
+}
+
+TEST(ExternalSortSuite, double_buffered_run_generation) {
+  std::string input_file_name("double_buffered_input.txt");
+  std::string output_file_name("double_buffered_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  ExternalSort::SortOptions options;
+  options.run_generation = ExternalSort::DOUBLE_BUFFERED;
+  ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+      input_file_name, output_file_name, tmp_dir, 2, 10, 30'000'000, 4096,
+      false, options);
+
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+// Values the replacement selection heap ends up holding within memory_bound:
+// it doubles from 1024 values while the old and the new array both fit.
+static unsigned long
+replacement_selection_heap_values(unsigned long memory_bound,
+                                  unsigned long value_size) {
+  const auto values = memory_bound / value_size;
+  unsigned long capacity = 0;
+  for (;;) {
+    auto next = std::max<unsigned long>(2 * capacity, 1024);
+    if (capacity + next > values)
+      next = values > capacity ? values - capacity : 0;
+    if (next <= capacity)
+      return capacity;
+    capacity = next;
+  }
+}
+
+TEST(ExternalSortSuite, replacement_selection_run_generation) {
+  std::string input_file_name("replacement_selection_input.txt");
+  std::string output_file_name("replacement_selection_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  const unsigned long memory_budget = 3'000'000;
+  std::vector<int> values(max_value + 1);
+  for (int i = 0; i <= max_value; i++)
+    values[i] = i;
+  auto write_values = [&]() {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (auto value : values)
+      ofs << transform_int_to_str_padded(value, 9) << '\n';
+  };
+
+  ExternalSort::SortOptions options;
+  options.run_generation = ExternalSort::REPLACEMENT_SELECTION;
+  using Sort =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>;
+
+  // random input gives runs of about twice the values the heap holds
+  std::shuffle(values.begin(), values.end(), std::mt19937(42));
+  write_values();
+  auto report = Sort::sort(input_file_name, output_file_name, tmp_dir, 1, 10,
+                           memory_budget, 4096, false, options);
+  assert_padded_lines_sorted(output_file_name, max_value);
+  const auto expected_runs =
+      (max_value + 1) /
+      (2.0 * replacement_selection_heap_values(
+                 memory_budget - 11 * 4096,
+                 sizeof(std::pair<ExternalSort::LightStringSortConnector,
+                                  int>)));
+  ASSERT_GE(report.runs, 0.8 * expected_runs);
+  ASSERT_LE(report.runs, 1.25 * expected_runs + 1);
+
+  // values displaced by less than the heap holds stay in a single run
+  std::sort(values.begin(), values.end());
+  for (int i = 0; i + 1000 <= max_value; i += 1000)
+    std::reverse(values.begin() + i, values.begin() + i + 1000);
+  write_values();
+  report = Sort::sort(input_file_name, output_file_name, tmp_dir, 1, 10,
+                      memory_budget, 4096, false, options);
+  assert_padded_lines_sorted(output_file_name, max_value);
+  ASSERT_EQ(report.runs, 1UL);
+}
+
+TEST(ExternalSortSuite, parallel_ranges_run_generation) {
+  std::string input_file_name("parallel_ranges_input.txt");
+  std::string output_file_name("parallel_ranges_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  ExternalSort::SortOptions options;
+  options.run_generation = ExternalSort::PARALLEL_RANGES;
+  ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+      input_file_name, output_file_name, tmp_dir, 4, 10, 30'000'000, 4096,
+      false, options);
+
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, sample_sort_engine) {
+  std::string input_file_name("sample_sort_input.txt");
+  std::string output_file_name("sample_sort_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  ExternalSort::SortOptions options;
+  options.sort_engine = ExternalSort::SAMPLE_SORT;
+  ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+      input_file_name, output_file_name, tmp_dir, 4, 10, 30'000'000, 4096,
+      false, options);
+
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, prefix_string_connector) {
+  std::string input_file_name("prefix_string_input.txt");
+  std::string output_file_name("prefix_string_output.txt");
+  std::string tmp_dir("./");
+
+  // long shared prefixes, lines shorter than the key prefix and duplicates
+  std::vector<std::string> lines;
+  std::mt19937 generator(7);
+  for (int i = 0; i < 300'000; i++) {
+    auto value = static_cast<int>(generator() % 200'000);
+    if (i % 3 == 0)
+      lines.push_back("https://example.com/item/" +
+                      transform_int_to_str_padded(value, 6));
+    else if (i % 3 == 1)
+      lines.push_back(std::to_string(value % 1000));
+    else
+      lines.push_back("https://example.co" + std::to_string(value));
+  }
+  lines.push_back("");
+  {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (auto &line : lines)
+      ofs << line << '\n';
+  }
+
+  ExternalSort::ExternalSort<ExternalSort::PrefixStringSortConnector>::sort(
+      input_file_name, output_file_name, tmp_dir, 2, 4, 2'000'000, 4096, true);
+
+  std::sort(lines.begin(), lines.end());
+  lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+  std::ifstream ifs(output_file_name, std::ios::in);
+  std::string line;
+  unsigned long i = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_LT(i, lines.size());
+    ASSERT_EQ(line, lines[i]);
+    i++;
+  }
+  ASSERT_EQ(i, lines.size());
+}
+
+TEST(ExternalSortSuite, binary_safe_lines) {
+  std::string input_file_name("binary_lines_input.txt");
+  std::string output_file_name("binary_lines_output.txt");
+  std::string tmp_dir("./");
+
+  // inline and heap sized lines, some of them with embedded NUL bytes
+  std::vector<std::string> lines;
+  std::mt19937 generator(11);
+  for (int i = 0; i < 200'000; i++) {
+    std::string line(1 + generator() % 40, 'a');
+    for (auto &c : line)
+      c = static_cast<char>(generator() % 4);
+    for (auto &c : line)
+      if (c != '\0')
+        c = static_cast<char>('a' + c);
+    lines.push_back(line);
+  }
+  {
+    std::ofstream ofs(input_file_name, std::ios::out | std::ios::binary);
+    for (auto &line : lines)
+      ofs << line << '\n';
+  }
+
+  ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+      input_file_name, output_file_name, tmp_dir, 1, 4, 2'000'000, 4096, true);
+
+  std::sort(lines.begin(), lines.end());
+  lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+  std::ifstream ifs(output_file_name, std::ios::in | std::ios::binary);
+  std::string line;
+  unsigned long i = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_LT(i, lines.size());
+    ASSERT_EQ(line, lines[i]);
+    i++;
+  }
+  ASSERT_EQ(i, lines.size());
+}
+
+TEST(ExternalSortSuite, memory_report_within_budget) {
+  std::string input_file_name("memory_report_input.txt");
+  std::string output_file_name("memory_report_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  const unsigned long memory_budget = 8'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  for (auto run_generation :
+       {ExternalSort::LOAD_SORT_SPILL, ExternalSort::DOUBLE_BUFFERED,
+        ExternalSort::REPLACEMENT_SELECTION, ExternalSort::PARALLEL_RANGES}) {
+    ExternalSort::SortOptions options;
+    options.run_generation = run_generation;
+    auto report =
+        ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::
+            sort(input_file_name, output_file_name, tmp_dir, 2, 10,
+                 memory_budget, 4096, false, options);
+
+    ASSERT_EQ(report.memory_budget, memory_budget);
+    ASSERT_GT(report.memory_peak, memory_budget / 2) << run_generation;
+    ASSERT_LE(report.memory_peak, memory_budget) << run_generation;
+    ASSERT_GT(report.runs, 1UL) << run_generation;
+    assert_padded_lines_sorted(output_file_name, max_value);
+  }
+}
+
+TEST(ExternalSortSuite, memory_budget_too_small) {
+  std::string input_file_name("memory_too_small_input.txt");
+  std::string output_file_name("memory_too_small_output.txt");
+  std::string tmp_dir("./");
+  write_reversed_padded_lines(input_file_name, 1000);
+
+  ASSERT_THROW(
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 1, 10, 50'000, 4096,
+          false),
+      std::runtime_error);
+}
+
+TEST(ExternalSortSuite, high_fan_in_remove_duplicates) {
+  std::string input_file_name("high_fan_in_input.txt");
+  std::string output_file_name("high_fan_in_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 100'000;
+  {
+    std::mt19937 generator(5);
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (int i = 0; i < 500'000; i++)
+      ofs << transform_int_to_str_padded(
+                 static_cast<int>(generator() % (max_value + 1)), 9)
+          << '\n';
+    // every value appears at least once
+    for (int i = 0; i <= max_value; i++)
+      ofs << transform_int_to_str_padded(i, 9) << '\n';
+  }
+
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::PrefixStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 1, 64, 2'000'000, 4096,
+          true);
+  ASSERT_GT(report.runs, 10UL);
+
+  std::ifstream ifs(output_file_name, std::ios::in);
+  std::string line;
+  int i = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_EQ(line, transform_int_to_str_padded(i, 9));
+    i++;
+  }
+  ASSERT_EQ(i, max_value + 1);
+}
+
+TEST(ExternalSortSuite, concurrent_merge_levels) {
+  std::string input_file_name("concurrent_merge_input.txt");
+  std::string output_file_name("concurrent_merge_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  const unsigned long memory_budget = 4'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  // several merge levels with three files per group
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 4, 3, memory_budget,
+          4096, false);
+
+  ASSERT_GT(report.runs, 9UL);
+  ASSERT_LE(report.memory_peak, memory_budget);
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, parallel_final_merge_remove_duplicates) {
+  std::string input_file_name("parallel_final_merge_input.txt");
+  std::string output_file_name("parallel_final_merge_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 200'000;
+  {
+    std::mt19937 generator(11);
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (int i = 0; i < 600'000; i++)
+      ofs << transform_int_to_str_padded(
+                 static_cast<int>(generator() % (max_value + 1)), 9)
+          << '\n';
+    for (int i = 0; i <= max_value; i++)
+      ofs << transform_int_to_str_padded(i, 9) << '\n';
+  }
+
+  // a single merge level, split over the four workers
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 4, 64, 8'000'000, 4096,
+          true);
+  ASSERT_GT(report.runs, 1UL);
+  ASSERT_LE(report.memory_peak, 8'000'000UL);
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, parallel_final_merge_no_header) {
+  std::string input_file_name("parallel_final_merge_no_header_input.txt");
+  std::string output_file_name("parallel_final_merge_no_header_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  // the parts are written at their offsets of a result starting at byte 0
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 4, 64, 8'000'000, 4096,
+          false);
+  ASSERT_GT(report.runs, 1UL);
+  ASSERT_EQ(report.merges, 1UL);
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, huffman_merge_schedule) {
+  std::string input_file_name("huffman_merge_input.txt");
+  std::string output_file_name("huffman_merge_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 500'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 1, 4, 2'000'000, 4096,
+          false);
+
+  // every merge but the first one takes four files
+  ASSERT_GT(report.runs, 4UL);
+  ASSERT_EQ(report.merge_fan_in, 4UL);
+  ASSERT_EQ(report.merges, (report.runs - 1 + 2) / 3);
+  ASSERT_GT(report.merge_bytes, 0UL);
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, budget_planned_merge) {
+  std::string input_file_name("budget_planned_merge_input.txt");
+  std::string output_file_name("budget_planned_merge_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  const unsigned long memory_budget = 6'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  ExternalSort::SortOptions options;
+  options.merge_sizing = ExternalSort::BUDGET_FAN_IN;
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dir, 2, 256, memory_budget,
+          4096, false, options);
+
+  ASSERT_GT(report.runs, 2UL);
+  ASSERT_GE(report.merge_fan_in, 2UL);
+  ASSERT_LE(report.merge_fan_in, report.runs);
+  ASSERT_EQ(report.merges,
+            (report.runs - 1 + report.merge_fan_in - 2) /
+                (report.merge_fan_in - 1));
+  // blocks grow past the minimum when the budget allows
+  ASSERT_GT(report.merge_block_size, 4096UL);
+  ASSERT_EQ(report.merge_block_size % 4096, 0UL);
+  ASSERT_LE(report.memory_peak, memory_budget);
+  assert_padded_lines_sorted(output_file_name, max_value);
+}
+
+TEST(ExternalSortSuite, sort_into_consumer) {
+  std::string input_file_name("sort_into_consumer_input.txt");
+  std::string tmp_dir("./");
+  const int max_value = 300'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  // several runs merged into the consumer, then a single run streamed to it
+  for (unsigned long memory_budget : {2'000'000UL, 100'000'000UL}) {
+    int i = 0;
+    ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::
+        consumer_t consumer =
+            [&](const ExternalSort::LightStringSortConnector &value) {
+              ASSERT_EQ(std::string(value.input_string.data(), value.size()),
+                        transform_int_to_str_padded(i, 9))
+                  << "failed at i = " << i;
+              i++;
+            };
+    auto report =
+        ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::
+            sort(input_file_name, consumer, tmp_dir, 2, 4, memory_budget,
+                 4096, false, ExternalSort::SortOptions());
+    ASSERT_EQ(i, max_value + 1);
+    ASSERT_GE(report.merges, 1UL);
+  }
+}
+
+TEST(ExternalSortSuite, merges_write_away_from_inputs) {
+  ExternalSort::TempDirs dirs(std::vector<std::string>{"d0", "d1", "d2"});
+  ExternalSort::TempPlacement placement(dirs);
+  // runs go round robin
+  ASSERT_EQ(placement.run_dir(), "d0");
+  ASSERT_EQ(placement.run_dir(), "d1");
+  ASSERT_EQ(placement.run_dir(), "d2");
+  ASSERT_EQ(placement.run_dir(), "d0");
+
+  placement.placed("d0/a", 100);
+  placement.placed("d1/b", 10);
+  placement.placed("d2/c", 50);
+  // the least loaded directory not being read from
+  ASSERT_EQ(placement.merge_dir({"d1/b"}), "d2");
+  ASSERT_EQ(placement.merge_dir({"d0/a", "d2/c"}), "d1");
+  // every directory is read from, the least loaded is taken
+  ASSERT_EQ(placement.merge_dir({"d0/a", "d1/b", "d2/c"}), "d1");
+}
+
+TEST(ExternalSortSuite, striped_tmp_dirs) {
+  std::string input_file_name("striped_tmp_dirs_input.txt");
+  std::string output_file_name("striped_tmp_dirs_output.txt");
+  std::vector<std::string> tmp_dirs = {"striped_tmp_0", "striped_tmp_1",
+                                       "striped_tmp_2"};
+  for (auto &dir : tmp_dirs)
+    std::filesystem::create_directories(dir);
+  const int max_value = 1'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  auto report =
+      ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::sort(
+          input_file_name, output_file_name, tmp_dirs, 4, 3, 4'000'000, 4096,
+          false);
+
+  ASSERT_GT(report.merges, 3UL);
+  assert_padded_lines_sorted(output_file_name, max_value);
+  for (auto &dir : tmp_dirs) {
+    ASSERT_TRUE(std::filesystem::is_empty(dir)) << dir;
+    std::filesystem::remove(dir);
+  }
+}
+
+TEST(ExternalSortSuite, striped_runs_of_nested_inputs) {
+  std::filesystem::create_directories("nested_input/sub");
+  std::vector<std::string> tmp_dirs = {"nested_tmp_0", "nested_tmp_1"};
+  for (auto &dir : tmp_dirs)
+    std::filesystem::create_directories(dir);
+  auto files_in = [](const std::string &dir) {
+    return std::distance(std::filesystem::directory_iterator(dir),
+                         std::filesystem::directory_iterator());
+  };
+  const std::string input_file_name("nested_input/sub/input.txt");
+  const int max_value = 300'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  for (auto input : {input_file_name,
+                     std::filesystem::absolute(input_file_name).string()}) {
+    // the runs are listed while the final merge reads them
+    std::vector<long> runs_in_dirs;
+    long files_next_to_input = 0;
+    int i = 0;
+    ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::
+        consumer_t consumer =
+            [&](const ExternalSort::LightStringSortConnector &value) {
+              if (i == 0) {
+                for (auto &dir : tmp_dirs)
+                  runs_in_dirs.push_back(files_in(dir));
+                files_next_to_input = files_in("nested_input/sub");
+              }
+              ASSERT_EQ(std::string(value.input_string.data(), value.size()),
+                        transform_int_to_str_padded(i, 9))
+                  << "failed at i = " << i;
+              i++;
+            };
+    auto report =
+        ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::
+            sort(input, consumer, tmp_dirs, 1, 64, 2'000'000, 4096, false,
+                 ExternalSort::SortOptions());
+    ASSERT_EQ(i, max_value + 1);
+    ASSERT_GT(report.runs, 1UL);
+    ASSERT_EQ(report.merges, 1UL);
+    for (auto runs : runs_in_dirs)
+      ASSERT_GT(runs, 0L) << input;
+    ASSERT_EQ(files_next_to_input, 1L) << input;
+  }
+  for (auto &dir : tmp_dirs) {
+    ASSERT_TRUE(std::filesystem::is_empty(dir)) << dir;
+    std::filesystem::remove(dir);
+  }
+  std::filesystem::remove_all("nested_input");
+}
+
+TEST(ExternalSortSuite, concatenate_disjoint_runs) {
+  std::string input_file_name("concatenate_disjoint_input.txt");
+  std::string output_file_name("concatenate_disjoint_output.txt");
+  std::string tmp_dir("./");
+  const int max_value = 1'000'000;
+  write_reversed_padded_lines(input_file_name, max_value);
+
+  ExternalSort::SortOptions options;
+  options.disjoint_runs = ExternalSort::CONCATENATE_DISJOINT;
+  options.run_format = ExternalSort::FRONT_CODED_RUNS;
+  // every run of a reversed input follows the next one, none is merged
+  for (bool remove_duplicates : {false, true}) {
+    for (auto run_generation :
+         {ExternalSort::LOAD_SORT_SPILL, ExternalSort::PARALLEL_RANGES}) {
+      options.run_generation = run_generation;
+      auto report =
+          ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector>::
+              sort(input_file_name, output_file_name, tmp_dir, 4, 3,
+                   4'000'000, 4096, remove_duplicates, options);
+      ASSERT_GT(report.runs, 9UL);
+      ASSERT_EQ(report.concatenated_runs, report.runs - 1);
+      // the front coded run is only decoded into the output
+      ASSERT_EQ(report.merges, 1UL);
+      assert_padded_lines_sorted(output_file_name, max_value);
+    }
+  }
+}
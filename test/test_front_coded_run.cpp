@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+
+#include <LightStringSortConnector.hpp>
+#include <algorithm>
+#include <front_coded_run.hpp>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static std::vector<std::string>
+round_trip(const std::vector<std::string> &lines, std::size_t &bytes) {
+  std::stringstream stream;
+  {
+    ExternalSort::FrontCodedRunWriter writer(stream);
+    for (auto &line : lines)
+      writer.write_line(line.data(), line.size());
+  }
+  bytes = stream.str().size();
+  ExternalSort::FrontCodedRunReader reader(stream);
+  std::vector<std::string> result;
+  const char *line;
+  unsigned long length;
+  while (reader.read_line(line, length))
+    result.emplace_back(line, length);
+  return result;
+}
+
+TEST(FrontCodedRun, shared_prefixes_are_stored_once) {
+  static_assert(ExternalSort::front_codes_runs<
+                ExternalSort::LightStringSortConnector>::value);
+  std::vector<std::string> lines;
+  std::size_t raw = 0;
+  for (int i = 0; i < 20'000; i++) {
+    lines.push_back("https://example.com/catalog/products/item-" +
+                    std::to_string(1'000'000 + i));
+    raw += lines.back().size() + 1;
+  }
+  std::size_t bytes = 0;
+  ASSERT_EQ(round_trip(lines, bytes), lines);
+  ASSERT_LT(bytes, raw / 2);
+}
+
+TEST(FrontCodedRun, empty_long_and_repeated_lines) {
+  std::mt19937 generator(5);
+  std::vector<std::string> lines = {"", "", "a", "a", "ab", "b"};
+  for (int i = 0; i < 100; i++) {
+    std::string line(generator() % 300, 'x');
+    for (auto &c : line)
+      c = static_cast<char>(generator() % 256);
+    lines.push_back(line);
+  }
+  std::sort(lines.begin() + 6, lines.end());
+  std::size_t bytes = 0;
+  ASSERT_EQ(round_trip(lines, bytes), lines);
+  ASSERT_TRUE(round_trip({}, bytes).empty());
+}
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include <introsort.hpp>
+#include <sample_sort.hpp>
 
 #include <chrono>
 #include <string>
@@ -119,3 +120,20 @@ TEST(inplace_introsort, test_intro_sort_duplicates) {
     }
   }
 }
+
+TEST(inplace_sample_sort, test_sample_sort_strings_and_duplicates) {
+  std::vector<StringAdapter> data;
+  const int max_value = 200000;
+  for (int i = max_value - 1; i >= 0; i--) {
+    data.emplace_back(transform_int_to_str_padded(i % 50000, 10));
+  }
+  std::mt19937 generator(17);
+  std::shuffle(data.begin(), data.end(), generator);
+
+  StringAdapter::Comparator comp;
+  ExternalSort::SampleSort<StringAdapter>::sort(data, comp, 4);
+
+  for (int i = 0; i < max_value; i++) {
+    ASSERT_EQ(data[i].value, transform_int_to_str_padded(i / 4, 10));
+  }
+}
@@ -3,11 +3,16 @@
 //
 #include <gtest/gtest.h>
 
+#include <LightStringSortConnector.hpp>
+#include <MmapIOHandler.hpp>
 #include <ULHeaderIOHandler.hpp>
 #include <UnsignedLongSortConnectorWHeader.hpp>
+#include <algorithm>
 #include <external_sort.hpp>
 #include <fstream>
+#include <random>
 #include <string>
+#include <vector>
 
 static void write_ul(std::ofstream &ofs, unsigned long value) {
   ofs.write(reinterpret_cast<char *>(&value), sizeof(unsigned long));
@@ -126,4 +131,503 @@ TEST(IOHandlerWHeader, works_on_files_wheader_duplicates_remove_duplicates) {
     auto value = read_ul(ifs);
     ASSERT_EQ(value, i) << "failed at i = " << i;
   }
-}
\ No newline at end of file
+}
+
+TEST(IOHandlerWHeader, replacement_selection_remove_duplicates) {
+  const std::string ul_data("replacement_selection_wheader.bin");
+  const std::string sorted_ul_data("replacement_selection_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'000L;
+  const auto repetition = 3L;
+  const auto total_sz = sz * repetition;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, total_sz);
+
+    for (long j = 0; j < repetition; j++) {
+      for (long i = 0; i < sz; i++) {
+        write_ul(ofs, (i * 7919L) % sz);
+      }
+    }
+  }
+
+  ExternalSort::SortOptions options;
+  options.run_generation = ExternalSort::REPLACEMENT_SELECTION;
+  ExternalSort::ExternalSort<
+      ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+      ExternalSort::NoTimeControl,
+      ExternalSort::ULHeaderIOHandler>::sort(ul_data, sorted_ul_data, tmp_dir,
+                                             1, 10, 1'000'000, 4096, true,
+                                             options);
+
+  std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+
+  auto extracted_sz = read_ul(ifs);
+  ASSERT_EQ(extracted_sz, sz);
+  for (size_t i = 0; i < sz; i++) {
+    auto value = read_ul(ifs);
+    ASSERT_EQ(value, i) << "failed at i = " << i;
+  }
+}
+
+TEST(IOHandlerWHeader, parallel_ranges_wheader) {
+  const std::string ul_data("parallel_ranges_wheader.bin");
+  const std::string sorted_ul_data("parallel_ranges_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'003L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, sz);
+
+    for (long i = sz - 1; i > -1L; i--) {
+      write_ul(ofs, i);
+    }
+  }
+
+  ExternalSort::SortOptions options;
+  options.run_generation = ExternalSort::PARALLEL_RANGES;
+  ExternalSort::ExternalSort<
+      ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+      ExternalSort::NoTimeControl,
+      ExternalSort::ULHeaderIOHandler>::sort(ul_data, sorted_ul_data, tmp_dir,
+                                             3, 10, 4'000'000, 4096, false,
+                                             options);
+
+  std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+
+  auto extracted_sz = read_ul(ifs);
+  ASSERT_EQ(extracted_sz, sz);
+  for (size_t i = 0; i < sz; i++) {
+    auto value = read_ul(ifs);
+    ASSERT_EQ(value, i) << "failed at i = " << i;
+  }
+}
+
+TEST(IOHandlerWHeader, parallel_final_merge_wheader) {
+  const std::string ul_data("parallel_final_merge_wheader.bin");
+  const std::string sorted_ul_data("parallel_final_merge_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'000L;
+  const auto repetition = 2L;
+  for (bool remove_duplicates : {false, true}) {
+    {
+      std::ofstream ofs(ul_data,
+                        std::ios::binary | std::ios::out | std::ios::trunc);
+      write_ul(ofs, sz * repetition);
+
+      for (long j = 0; j < repetition; j++) {
+        for (long i = 0; i < sz; i++) {
+          write_ul(ofs, (i * 7919L) % sz);
+        }
+      }
+    }
+
+    ExternalSort::ExternalSort<
+        ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+        ExternalSort::NoTimeControl,
+        ExternalSort::ULHeaderIOHandler>::sort(ul_data, sorted_ul_data,
+                                               tmp_dir, 4, 64, 4'000'000, 4096,
+                                               remove_duplicates);
+
+    std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+
+    const auto copies = remove_duplicates ? 1L : repetition;
+    auto extracted_sz = read_ul(ifs);
+    ASSERT_EQ(extracted_sz, sz * copies);
+    for (long i = 0; i < sz; i++) {
+      for (long j = 0; j < copies; j++) {
+        auto value = read_ul(ifs);
+        ASSERT_EQ(value, i) << "failed at i = " << i;
+      }
+    }
+    read_ul(ifs);
+    ASSERT_TRUE(ifs.eof());
+  }
+}
+
+// Every value is preceded by a tag byte, which sorts must neither parse as
+// a value nor drop
+class TaggedIOHandler {
+public:
+  static constexpr char tag = '#';
+
+  class Reader {
+    std::ifstream &is;
+
+  public:
+    explicit Reader(std::ifstream &is) : is(is) {}
+
+    template <typename T, typename... Storage>
+    bool read_value(T &out, Storage &...storage) {
+      if (is.get() != tag)
+        return false;
+      return T::read_value(is, out, storage...);
+    }
+  };
+
+  class Writer {
+    std::ofstream &ofs;
+
+  public:
+    Writer(std::ofstream &ofs, unsigned long) : ofs(ofs) {}
+
+    template <typename T> void write_value(const T &input) {
+      ofs.put(tag);
+      ofs << input;
+    }
+    template <typename T> void fix_headers(const T &) {}
+  };
+};
+
+TEST(IOHandlerWHeader, parallel_sort_tagged_records) {
+  const std::string ul_data("parallel_sort_tagged_records.bin");
+  const std::string sorted_ul_data("parallel_sort_tagged_records.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'000L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    for (long i = 0; i < sz; i++) {
+      ofs.put(TaggedIOHandler::tag);
+      write_ul(ofs, (i * 7919L) % sz);
+    }
+  }
+
+  // neither the input nor the runs can be cut in ranges by the workers
+  for (auto run_generation :
+       {ExternalSort::LOAD_SORT_SPILL, ExternalSort::PARALLEL_RANGES}) {
+    ExternalSort::SortOptions options;
+    options.run_generation = run_generation;
+    auto report = ExternalSort::ExternalSort<
+        ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+        ExternalSort::NoTimeControl,
+        TaggedIOHandler>::sort(ul_data, sorted_ul_data, tmp_dir, 4, 64,
+                               8'000'000, 4096, false, options);
+    ASSERT_GT(report.runs, 1UL);
+
+    std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+    for (long i = 0; i < sz; i++) {
+      ASSERT_EQ(ifs.get(), TaggedIOHandler::tag) << "failed at i = " << i;
+      auto value = read_ul(ifs);
+      ASSERT_EQ(value, i) << "failed at i = " << i;
+    }
+    ifs.get();
+    ASSERT_TRUE(ifs.eof());
+  }
+}
+
+TEST(IOHandlerWHeader, mapped_runs_wheader) {
+  const std::string ul_data("mapped_runs_wheader.bin");
+  const std::string sorted_ul_data("mapped_runs_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'003L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, sz);
+    for (long i = 0; i < sz; i++)
+      write_ul(ofs, (i * 7919L) % sz);
+  }
+
+  static_assert(ExternalSort::reads_mapped<
+                ExternalSort::UnsignedLongSortConnectorWHeader,
+                std::tuple<>>::value);
+  // a small window slides many times over every file
+  auto report = ExternalSort::ExternalSort<
+      ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+      ExternalSort::NoTimeControl,
+      ExternalSort::MmapIOHandler<1UL << 16, ExternalSort::ULHeaderIOHandler>>::
+      sort(ul_data, sorted_ul_data, tmp_dir, 2, 4, 2'000'000, 4096, false);
+  ASSERT_GT(report.runs, 4UL);
+
+  std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+  ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(sz));
+  for (long i = 0; i < sz; i++) {
+    auto value = read_ul(ifs);
+    ASSERT_EQ(value, i) << "failed at i = " << i;
+  }
+}
+
+TEST(IOHandlerWHeader, mapped_reads_stop_at_header_count) {
+  const std::string ul_data("mapped_header_count.bin");
+  const std::string sorted_ul_data("mapped_header_count.sorted.bin");
+  const std::string tmp_dir("./");
+
+  // values past the count of the header are not part of the file
+  const auto sz = 100'000L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, sz);
+    for (long i = 0; i < sz; i++)
+      write_ul(ofs, (i * 7919L) % sz);
+    for (long i = 0; i < 10; i++)
+      write_ul(ofs, sz + i);
+  }
+
+  ExternalSort::ExternalSort<
+      ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+      ExternalSort::NoTimeControl,
+      ExternalSort::MmapIOHandler<1UL << 16, ExternalSort::ULHeaderIOHandler>>::
+      sort(ul_data, sorted_ul_data, tmp_dir, 2, 4, 2'000'000, 4096, false);
+
+  std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+  ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(sz));
+  for (long i = 0; i < sz; i++) {
+    auto value = read_ul(ifs);
+    ASSERT_EQ(value, i) << "failed at i = " << i;
+  }
+  read_ul(ifs);
+  ASSERT_TRUE(ifs.eof());
+}
+
+// Sorts to an output in a directory that doesn't exist
+template <typename IOHandler> static void sort_to_missing_dir() {
+  const std::string input_file_name("missing_dir_input.txt");
+  {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (long i = 0; i < 300'000; i++)
+      ofs << (i * 7919L) % 300'000 << '\n';
+  }
+  ExternalSort::ExternalSort<ExternalSort::LightStringSortConnector,
+                             ExternalSort::TEXT, ExternalSort::NoTimeControl,
+                             IOHandler>::sort(input_file_name,
+                                              "missing_dir/output.txt", "./",
+                                              2, 10, 4'000'000, 4096, false);
+}
+
+TEST(IOHandlerWHeader, unopenable_output_throws) {
+  ASSERT_ANY_THROW(sort_to_missing_dir<ExternalSort::DefaultIOHandler>());
+  ASSERT_ANY_THROW(sort_to_missing_dir<ExternalSort::MmapIOHandler<4096>>());
+}
+
+TEST(IOHandlerWHeader, mapped_text_lines) {
+  const std::string input_file_name("mapped_text_lines.txt");
+  const std::string output_file_name("mapped_text_lines.sorted.txt");
+  const std::string tmp_dir("./");
+
+  static_assert(ExternalSort::reads_mapped<ExternalSort::ArenaStringHandle,
+                                           std::tuple<StringArena>>::value);
+  // some lines are longer than the mapped window, the last has no newline
+  std::vector<std::string> lines;
+  std::mt19937 generator(3);
+  for (int i = 0; i < 200'000; i++) {
+    auto length = i % 10'000 == 0 ? 10'000 + generator() % 5'000
+                                  : generator() % 40;
+    std::string line(length, 'a');
+    for (auto &c : line)
+      c = static_cast<char>('a' + generator() % 26);
+    lines.push_back(line);
+  }
+  {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (size_t i = 0; i < lines.size(); i++)
+      ofs << lines[i] << (i + 1 < lines.size() ? "\n" : "");
+  }
+  std::sort(lines.begin(), lines.end());
+
+  auto report = ExternalSort::ExternalSort<
+      ExternalSort::LightStringSortConnector, ExternalSort::TEXT,
+      ExternalSort::NoTimeControl,
+      ExternalSort::MmapIOHandler<4096>>::sort(input_file_name,
+                                               output_file_name, tmp_dir, 2, 4,
+                                               2'000'000, 4096, false);
+  ASSERT_GT(report.runs, 1UL);
+
+  std::ifstream ifs(output_file_name, std::ios::in);
+  std::string line;
+  size_t i = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_LT(i, lines.size());
+    ASSERT_EQ(line, lines[i]) << "failed at i = " << i;
+    i++;
+  }
+  ASSERT_EQ(i, lines.size());
+}
+
+TEST(IOHandlerWHeader, packed_runs_wheader) {
+  const std::string ul_data("packed_runs_wheader.bin");
+  const std::string sorted_ul_data("packed_runs_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  static_assert(ExternalSort::packs_runs<
+                ExternalSort::UnsignedLongSortConnectorWHeader>::value);
+  const auto sz = 1'000'000L;
+  const auto repetition = 2L;
+  ExternalSort::SortOptions options;
+  options.run_format = ExternalSort::PACKED_RUNS;
+  for (bool remove_duplicates : {false, true}) {
+    {
+      std::ofstream ofs(ul_data,
+                        std::ios::binary | std::ios::out | std::ios::trunc);
+      write_ul(ofs, sz * repetition);
+      for (long j = 0; j < repetition; j++)
+        for (long i = 0; i < sz; i++)
+          write_ul(ofs, (i * 7919L) % sz);
+    }
+
+    // a fan-in of 4 leaves intermediate merges of packed runs
+    auto report = ExternalSort::ExternalSort<
+        ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+        ExternalSort::NoTimeControl,
+        ExternalSort::ULHeaderIOHandler>::sort(ul_data, sorted_ul_data,
+                                               tmp_dir, 2, 4, 4'000'000, 4096,
+                                               remove_duplicates, options);
+    ASSERT_GT(report.merges, 1UL);
+    ASSERT_LT(report.merge_bytes, sz * repetition * sizeof(long) / 4);
+
+    std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+    const auto copies = remove_duplicates ? 1L : repetition;
+    ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(sz * copies));
+    for (long i = 0; i < sz; i++) {
+      for (long j = 0; j < copies; j++) {
+        auto value = read_ul(ifs);
+        ASSERT_EQ(value, i) << "failed at i = " << i;
+      }
+    }
+    read_ul(ifs);
+    ASSERT_TRUE(ifs.eof());
+  }
+}
+
+TEST(IOHandlerWHeader, front_coded_text_runs) {
+  const std::string input_file_name("front_coded_text_runs.txt");
+  const std::string output_file_name("front_coded_text_runs.sorted.txt");
+  const std::string tmp_dir("./");
+
+  std::vector<std::string> lines;
+  unsigned long input_size = 0;
+  std::mt19937 generator(7);
+  for (int i = 0; i < 200'000; i++) {
+    lines.push_back("https://example.com/" +
+                    std::to_string(generator() % 50) + "/path/to/resource/" +
+                    std::to_string(generator() % 100'000));
+    input_size += lines.back().size() + 1;
+  }
+  {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (auto &line : lines)
+      ofs << line << "\n";
+  }
+  std::sort(lines.begin(), lines.end());
+
+  ExternalSort::SortOptions options;
+  options.run_format = ExternalSort::FRONT_CODED_RUNS;
+  for (auto run_generation :
+       {ExternalSort::LOAD_SORT_SPILL, ExternalSort::REPLACEMENT_SELECTION}) {
+    options.run_generation = run_generation;
+    // a fan-in of 4 leaves intermediate merges of front coded runs
+    auto report = ExternalSort::ExternalSort<
+        ExternalSort::LightStringSortConnector, ExternalSort::TEXT>::
+        sort(input_file_name, output_file_name, tmp_dir, 2, 4, 2'000'000,
+             4096, false, options);
+    ASSERT_GT(report.merges, 1UL);
+    ASSERT_LT(report.merge_bytes, input_size);
+
+    std::ifstream ifs(output_file_name, std::ios::in);
+    std::string line;
+    size_t i = 0;
+    while (std::getline(ifs, line)) {
+      ASSERT_LT(i, lines.size());
+      ASSERT_EQ(line, lines[i]) << "failed at i = " << i;
+      i++;
+    }
+    ASSERT_EQ(i, lines.size());
+  }
+}
+
+TEST(IOHandlerWHeader, concatenate_disjoint_runs_wheader) {
+  const std::string ul_data("concatenate_disjoint_wheader.bin");
+  const std::string sorted_ul_data("concatenate_disjoint_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  // sorted values followed by a few that overlap every run
+  const auto sz = 1'000'000L;
+  std::vector<unsigned long> values;
+  for (long i = 0; i < sz; i++)
+    values.push_back(static_cast<unsigned long>(i));
+  std::mt19937 generator(11);
+  for (int i = 0; i < 100; i++)
+    values.push_back(generator() % sz);
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, values.size());
+    for (auto value : values)
+      write_ul(ofs, value);
+  }
+  std::sort(values.begin(), values.end());
+
+  ExternalSort::SortOptions options;
+  options.disjoint_runs = ExternalSort::CONCATENATE_DISJOINT;
+  for (auto run_format : {ExternalSort::RAW_RUNS, ExternalSort::PACKED_RUNS}) {
+    options.run_format = run_format;
+    auto report = ExternalSort::ExternalSort<
+        ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+        ExternalSort::NoTimeControl,
+        ExternalSort::ULHeaderIOHandler>::sort(ul_data, sorted_ul_data,
+                                               tmp_dir, 2, 4, 2'000'000, 4096,
+                                               false, options);
+    // the last run overlaps the others, which are appended into one
+    ASSERT_GT(report.runs, 4UL);
+    ASSERT_EQ(report.concatenated_runs, report.runs - 2);
+    ASSERT_EQ(report.merges, 1UL);
+
+    std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+    ASSERT_EQ(read_ul(ifs), values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+      auto value = read_ul(ifs);
+      ASSERT_EQ(value, values[i]) << "failed at i = " << i;
+    }
+    read_ul(ifs);
+    ASSERT_TRUE(ifs.eof());
+  }
+}
+
+// The files of ULHeaderIOHandler, without header_size nor raw_records
+struct OpaqueULHeaderIOHandler {
+  using Reader = ExternalSort::ULHeaderIOHandler::Reader;
+  using Writer = ExternalSort::ULHeaderIOHandler::Writer;
+};
+
+TEST(IOHandlerWHeader, concatenate_disjoint_runs_opaque_header) {
+  const std::string ul_data("concatenate_disjoint_opaque.bin");
+  const std::string sorted_ul_data("concatenate_disjoint_opaque.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'000L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, sz);
+    for (long i = 0; i < sz; i++)
+      write_ul(ofs, i);
+  }
+
+  // the runs can't be appended past headers of unknown size, so they merge
+  ExternalSort::SortOptions options;
+  options.disjoint_runs = ExternalSort::CONCATENATE_DISJOINT;
+  auto report = ExternalSort::ExternalSort<
+      ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+      ExternalSort::NoTimeControl,
+      OpaqueULHeaderIOHandler>::sort(ul_data, sorted_ul_data, tmp_dir, 2, 4,
+                                     2'000'000, 4096, false, options);
+  ASSERT_GT(report.runs, 4UL);
+  ASSERT_EQ(report.concatenated_runs, 0UL);
+
+  std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+  ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(sz));
+  for (long i = 0; i < sz; i++) {
+    auto value = read_ul(ifs);
+    ASSERT_EQ(value, i) << "failed at i = " << i;
+  }
+  read_ul(ifs);
+  ASSERT_TRUE(ifs.eof());
+}
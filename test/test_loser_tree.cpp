@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include <loser_tree.hpp>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+struct IntAdapter {
+  int value;
+  IntAdapter() : value(0) {}
+  explicit IntAdapter(int value) : value(value) {}
+  struct Comparator {
+    bool operator()(const IntAdapter &lhs, const IntAdapter &rhs) {
+      return lhs.value < rhs.value;
+    }
+  };
+};
+
+// Merges the sorted sources through a loser tree
+static std::vector<int> merge(std::vector<std::vector<IntAdapter>> &sources) {
+  std::vector<std::size_t> positions(sources.size(), 0);
+  std::vector<const IntAdapter *> heads;
+  for (auto &source : sources)
+    heads.push_back(source.empty() ? nullptr : &source[0]);
+
+  IntAdapter::Comparator comp;
+  ExternalSort::LoserTree<IntAdapter> tree(std::move(heads), comp);
+  std::vector<int> merged;
+  while (!tree.empty()) {
+    int source = tree.winner();
+    merged.push_back(tree.top().value);
+    auto position = ++positions[source];
+    tree.replace_winner(position < sources[source].size()
+                            ? &sources[source][position]
+                            : nullptr);
+  }
+  return merged;
+}
+
+TEST(loser_tree, merges_any_number_of_sources) {
+  std::mt19937 generator(3);
+  for (int k = 0; k <= 37; k++) {
+    std::vector<std::vector<IntAdapter>> sources(k);
+    std::vector<int> expected;
+    for (auto &source : sources) {
+      // some sources are empty and values repeat across sources
+      int length = static_cast<int>(generator() % 50);
+      for (int i = 0; i < length; i++) {
+        int value = static_cast<int>(generator() % 100);
+        source.emplace_back(value);
+        expected.push_back(value);
+      }
+      std::sort(source.begin(), source.end(), IntAdapter::Comparator());
+    }
+    std::sort(expected.begin(), expected.end());
+
+    ASSERT_EQ(merge(sources), expected) << "k = " << k;
+  }
+}
+
+TEST(loser_tree, single_source) {
+  std::vector<std::vector<IntAdapter>> sources(1);
+  for (int i = 0; i < 10; i++)
+    sources[0].emplace_back(i);
+  auto merged = merge(sources);
+  ASSERT_EQ(merged.size(), 10UL);
+  for (int i = 0; i < 10; i++)
+    ASSERT_EQ(merged[i], i);
+}
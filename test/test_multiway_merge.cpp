@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include <multiway_merge.hpp>
+
+#include <random>
+#include <string>
+
+struct IntAdapter {
+  int value;
+  IntAdapter() : value(0) {}
+  explicit IntAdapter(int value) : value(value) {}
+  struct Comparator {
+    bool operator()(const IntAdapter &lhs, const IntAdapter &rhs) {
+      return lhs.value < rhs.value;
+    }
+  };
+};
+
+static std::vector<int> sorted_segments(std::vector<IntAdapter> &data,
+                                        int segments) {
+  std::vector<int> offsets = {0};
+  for (int i = 1; i < segments; i++)
+    offsets.push_back(static_cast<int>(data.size() * i / segments));
+  offsets.push_back(static_cast<int>(data.size()));
+  IntAdapter::Comparator comp;
+  for (int i = 0; i < segments; i++)
+    std::sort(data.begin() + offsets[i], data.begin() + offsets[i + 1], comp);
+  return offsets;
+}
+
+TEST(multiway_merge, merges_segments_in_parallel) {
+  std::vector<IntAdapter> data;
+  const int max_value = 1'000'000;
+  for (int i = 0; i < max_value; i++)
+    data.emplace_back(i);
+  std::shuffle(data.begin(), data.end(), std::mt19937(7));
+
+  auto offsets = sorted_segments(data, 7);
+  std::vector<IntAdapter> out(data.size());
+  IntAdapter::Comparator comp;
+  ExternalSort::MultiwayMerge<IntAdapter>::merge(data, offsets, out, 4, comp);
+
+  for (int i = 0; i < max_value; i++) {
+    ASSERT_EQ(out[i].value, i);
+  }
+}
+
+TEST(multiway_merge, merges_segments_with_duplicates) {
+  std::vector<IntAdapter> data;
+  const int repetitions = 50;
+  const int max_value = 1000;
+  for (int j = 0; j < repetitions; j++)
+    for (int i = 0; i < max_value; i++)
+      data.emplace_back(i);
+  std::shuffle(data.begin(), data.end(), std::mt19937(11));
+
+  auto offsets = sorted_segments(data, 5);
+  std::vector<IntAdapter> out(data.size());
+  IntAdapter::Comparator comp;
+  ExternalSort::MultiwayMerge<IntAdapter>::merge(data, offsets, out, 8, comp);
+
+  for (int i = 0; i < max_value * repetitions; i++) {
+    ASSERT_EQ(out[i].value, i / repetitions);
+  }
+}
@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <packed_run.hpp>
+#include <random>
+#include <sstream>
+#include <vector>
+
+static std::vector<std::uint64_t>
+round_trip(const std::vector<std::uint64_t> &keys, std::size_t &bytes) {
+  std::stringstream stream;
+  {
+    ExternalSort::PackedRunWriter writer(stream);
+    for (auto key : keys)
+      writer.write_key(key);
+  }
+  bytes = stream.str().size();
+  ExternalSort::PackedRunReader reader(stream);
+  std::vector<std::uint64_t> result;
+  std::uint64_t key;
+  while (reader.read_key(key))
+    result.push_back(key);
+  return result;
+}
+
+TEST(PackedRun, dense_keys_take_a_few_bits) {
+  std::vector<std::uint64_t> keys;
+  std::mt19937_64 generator(1);
+  std::uint64_t key = 1'000'000'000'000;
+  for (int i = 0; i < 100'000; i++) {
+    key += generator() % 16;
+    keys.push_back(key);
+  }
+  std::size_t bytes = 0;
+  ASSERT_EQ(round_trip(keys, bytes), keys);
+  ASSERT_LT(bytes, keys.size() * sizeof(std::uint64_t) / 8);
+}
+
+TEST(PackedRun, duplicates_and_empty_run) {
+  std::size_t bytes = 0;
+  std::vector<std::uint64_t> keys(1'000, 42);
+  ASSERT_EQ(round_trip(keys, bytes), keys);
+  ASSERT_TRUE(round_trip({}, bytes).empty());
+  ASSERT_EQ(bytes, 0UL);
+}
+
+TEST(PackedRun, full_width_gaps_and_partial_block) {
+  std::size_t bytes = 0;
+  std::vector<std::uint64_t> keys = {0, ~0ULL, 1, ~0ULL - 1, 0};
+  ASSERT_EQ(round_trip(keys, bytes), keys);
+
+  // gaps of every width, with a last block that isn't full
+  keys.clear();
+  std::mt19937_64 generator(2);
+  for (unsigned i = 0; i < 3 * ExternalSort::packed_block_keys + 5; i++)
+    keys.push_back(generator() >> (generator() % 64));
+  ASSERT_EQ(round_trip(keys, bytes), keys);
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+
+#include <UnsignedLongSortConnector.hpp>
+#include <radix_sort.hpp>
+
+#include <limits>
+#include <random>
+
+struct DoubleAdapter {
+  double value;
+  DoubleAdapter() : value(0) {}
+  explicit DoubleAdapter(double value) : value(value) {}
+  unsigned long radix_key() const {
+    return ExternalSort::double_to_radix_key(value);
+  }
+};
+
+TEST(radix_sort, sorts_unsigned_long_connectors) {
+  std::vector<ExternalSort::UnsignedLongSortConnector> data;
+  std::vector<unsigned long> expected;
+  std::mt19937_64 generator(3);
+  for (int i = 0; i < 1'000'000; i++) {
+    auto value = generator();
+    data.emplace_back(value);
+    expected.push_back(value);
+  }
+  std::sort(expected.begin(), expected.end());
+
+  ExternalSort::RadixSort<ExternalSort::UnsignedLongSortConnector>::sort(data,
+                                                                         4);
+
+  for (size_t i = 0; i < expected.size(); i++) {
+    ASSERT_EQ(data[i].radix_key(), expected[i]);
+  }
+}
+
+TEST(radix_sort, sorts_small_ids_with_skipped_digits) {
+  std::vector<ExternalSort::UnsignedLongSortConnector> data;
+  for (long i = 99'999; i >= 0; i--) {
+    data.emplace_back(static_cast<unsigned long>(i) << 20);
+  }
+
+  ExternalSort::RadixSort<ExternalSort::UnsignedLongSortConnector>::sort(data,
+                                                                         2);
+
+  for (unsigned long i = 0; i < 100'000; i++) {
+    ASSERT_EQ(data[i].radix_key(), i << 20);
+  }
+}
+
+TEST(radix_sort, order_preserving_transforms) {
+  std::vector<long> signed_values = {std::numeric_limits<long>::min(), -5, -1,
+                                     0, 1, 7, std::numeric_limits<long>::max()};
+  for (size_t i = 0; i < signed_values.size(); i++) {
+    auto key = ExternalSort::signed_to_radix_key(signed_values[i]);
+    ASSERT_EQ(ExternalSort::radix_key_to_signed(key), signed_values[i]);
+    if (i > 0) {
+      ASSERT_LT(ExternalSort::signed_to_radix_key(signed_values[i - 1]), key);
+    }
+  }
+
+  std::vector<DoubleAdapter> data;
+  std::mt19937 generator(5);
+  std::uniform_real_distribution<double> distribution(-1e6, 1e6);
+  for (int i = 0; i < 100'000; i++) {
+    data.emplace_back(distribution(generator));
+  }
+  data.emplace_back(-std::numeric_limits<double>::infinity());
+  data.emplace_back(std::numeric_limits<double>::infinity());
+  data.emplace_back(-0.5);
+  data.emplace_back(0.0);
+
+  ExternalSort::RadixSort<DoubleAdapter>::sort(data, 1);
+
+  for (size_t i = 1; i < data.size(); i++) {
+    ASSERT_LE(data[i - 1].value, data[i].value);
+    ASSERT_EQ(ExternalSort::radix_key_to_double(data[i].radix_key()),
+              data[i].value);
+  }
+}
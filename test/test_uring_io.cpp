@@ -0,0 +1,221 @@
+#include <gtest/gtest.h>
+
+#include <LightStringSortConnector.hpp>
+#include <ULHeaderIOHandler.hpp>
+#include <UnsignedLongSortConnectorWHeader.hpp>
+#include <UringIOHandler.hpp>
+#include <external_sort.hpp>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static void write_ul(std::ofstream &ofs, unsigned long value) {
+  ofs.write(reinterpret_cast<char *>(&value), sizeof(unsigned long));
+}
+
+static unsigned long read_ul(std::ifstream &ifs) {
+  unsigned long result;
+  ifs.read(reinterpret_cast<char *>(&result), sizeof(unsigned long));
+  return result;
+}
+
+static std::string padded(int value) {
+  std::stringstream ss;
+  ss << std::setw(9) << std::setfill('0') << value;
+  return ss.str();
+}
+
+// Writes a file with a header rewritten at the end, then reads it back
+static void round_trip(const std::string &filename, bool direct) {
+  ExternalSort::UringQueue queue(8);
+  ExternalSort::io_buffer buffer(64 * 1024);
+  const unsigned long sz = 100'000;
+  {
+    std::ofstream ofs(filename, std::ios::out | std::ios::binary);
+    ExternalSort::attach_stream_buffer(
+        ofs, std::make_unique<ExternalSort::UringWriteBuf>(
+                 queue, ExternalSort::filebuf_fd(*ofs.rdbuf()), buffer.data(),
+                 buffer.size(), 4, direct));
+    write_ul(ofs, 0);
+    for (unsigned long i = 0; i < sz; i++)
+      write_ul(ofs, i);
+    // rewrite the header like ULHeaderIOHandler does
+    auto end = ofs.tellp();
+    ASSERT_EQ(static_cast<unsigned long>(end), (sz + 1) * sizeof(long));
+    ofs.seekp(0);
+    write_ul(ofs, sz);
+    ofs.seekp(end);
+  }
+
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  ExternalSort::attach_stream_buffer(
+      ifs, std::make_unique<ExternalSort::UringReadBuf>(
+               queue, ExternalSort::filebuf_fd(*ifs.rdbuf()), buffer.data(),
+               buffer.size(), 4, direct));
+  ASSERT_EQ(read_ul(ifs), sz);
+  for (unsigned long i = 0; i < sz; i++)
+    ASSERT_EQ(read_ul(ifs), i) << "failed at i = " << i;
+  read_ul(ifs);
+  ASSERT_TRUE(ifs.eof());
+
+  // unaligned seeks, far from the chunks loaded
+  ifs.clear();
+  for (unsigned long i : {sz / 2, 7UL, sz - 1}) {
+    ifs.seekg(static_cast<std::streamoff>((i + 1) * sizeof(long)));
+    ASSERT_EQ(read_ul(ifs), i);
+  }
+}
+
+TEST(UringIO, streambuf_round_trip) {
+  round_trip("uring_round_trip.bin", false);
+}
+
+TEST(UringIO, direct_streambuf_round_trip) {
+  round_trip("uring_direct_round_trip.bin", true);
+}
+
+TEST(UringIO, read_errors_set_badbit) {
+  const std::string filename("uring_read_error.bin");
+  {
+    std::ofstream ofs(filename, std::ios::out | std::ios::binary);
+    write_ul(ofs, 42);
+  }
+  ExternalSort::UringQueue queue(8);
+  ExternalSort::io_buffer buffer(64 * 1024);
+  // reads of a descriptor opened for writing fail with EBADF
+  int fd = open(filename.c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  {
+    ExternalSort::UringReadBuf read_buf(queue, fd, buffer.data(),
+                                        buffer.size(), 4);
+    std::istream is(&read_buf);
+    is.get();
+    ASSERT_TRUE(is.bad());
+  }
+  {
+    ExternalSort::UringReadBuf read_buf(queue, fd, buffer.data(),
+                                        buffer.size(), 4);
+    std::istream is(&read_buf);
+    is.exceptions(std::ios::badbit);
+    ASSERT_THROW(is.get(), std::ios_base::failure);
+  }
+  close(fd);
+}
+
+TEST(UringIO, unopenable_output_throws) {
+  const std::string input_file_name("uring_missing_dir_input.txt");
+  {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (int i = 0; i < 300'000; i++)
+      ofs << padded(i) << '\n';
+  }
+  // neither the output nor the runs of a missing directory can be opened
+  for (const std::string tmp_dir : {"./", "missing_dir/"})
+    ASSERT_ANY_THROW(
+        (ExternalSort::ExternalSort<
+            ExternalSort::LightStringSortConnector, ExternalSort::TEXT,
+            ExternalSort::NoTimeControl,
+            ExternalSort::UringIOHandler<>>::sort(input_file_name,
+                                                  "missing_dir/output.txt",
+                                                  tmp_dir, 2, 10, 4'000'000,
+                                                  4096, false)));
+}
+
+TEST(UringIO, sorts_text_runs) {
+  const std::string input_file_name("uring_text_input.txt");
+  const std::string output_file_name("uring_text_output.txt");
+  const std::string tmp_dir("./");
+  const int max_value = 500'000;
+  {
+    std::ofstream ofs(input_file_name, std::ios::out);
+    for (int i = max_value; i >= 0; i--)
+      ofs << padded(i) << '\n';
+  }
+
+  auto report = ExternalSort::ExternalSort<
+      ExternalSort::LightStringSortConnector, ExternalSort::TEXT,
+      ExternalSort::NoTimeControl,
+      ExternalSort::UringIOHandler<>>::sort(input_file_name, output_file_name,
+                                            tmp_dir, 2, 4, 3'000'000, 4096,
+                                            false);
+  ASSERT_GT(report.runs, 4UL);
+
+  std::ifstream ifs(output_file_name, std::ios::in);
+  std::string line;
+  int i = 0;
+  while (std::getline(ifs, line)) {
+    ASSERT_EQ(line, padded(i)) << "failed at i = " << i;
+    i++;
+  }
+  ASSERT_EQ(i, max_value + 1);
+}
+
+TEST(UringIO, sorts_files_wheader) {
+  const std::string ul_data("uring_wheader.bin");
+  const std::string sorted_ul_data("uring_wheader.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 1'000'003L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, sz);
+    for (long i = sz - 1; i > -1L; i--)
+      write_ul(ofs, i);
+  }
+
+  // parallel final merge without and with duplicate removal
+  for (bool remove_duplicates : {false, true}) {
+    auto report = ExternalSort::ExternalSort<
+        ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+        ExternalSort::NoTimeControl,
+        ExternalSort::UringIOHandler<16, 4, ExternalSort::ULHeaderIOHandler>>::
+        sort(ul_data, sorted_ul_data, tmp_dir, 4, 64, 4'000'000, 4096,
+             remove_duplicates);
+    ASSERT_GT(report.runs, 1UL);
+
+    std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+    ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(sz));
+    for (long i = 0; i < sz; i++)
+      ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(i))
+          << "failed at i = " << i;
+  }
+}
+
+TEST(UringIO, sorts_direct) {
+  const std::string ul_data("uring_direct.bin");
+  const std::string sorted_ul_data("uring_direct.sorted.bin");
+  const std::string tmp_dir("./");
+
+  const auto sz = 2'000'003L;
+  {
+    std::ofstream ofs(ul_data,
+                      std::ios::binary | std::ios::out | std::ios::trunc);
+    write_ul(ofs, sz);
+    for (long i = sz - 1; i > -1L; i--)
+      write_ul(ofs, (i * 7919L) % sz);
+  }
+
+  // blocks sized from the budget hold several aligned chunks
+  ExternalSort::SortOptions options;
+  options.merge_sizing = ExternalSort::BUDGET_FAN_IN;
+  auto report = ExternalSort::ExternalSort<
+      ExternalSort::UnsignedLongSortConnectorWHeader, ExternalSort::BINARY,
+      ExternalSort::NoTimeControl,
+      ExternalSort::UringIOHandler<16, 4, ExternalSort::ULHeaderIOHandler,
+                                   true>>::sort(ul_data, sorted_ul_data,
+                                                tmp_dir, 2, 64, 8'000'000,
+                                                4096, false, options);
+  ASSERT_GT(report.runs, 1UL);
+  ASSERT_GE(report.merge_block_size, 4 * ExternalSort::io_buffer_alignment);
+
+  std::ifstream ifs(sorted_ul_data, std::ios::in | std::ios::binary);
+  ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(sz));
+  for (long i = 0; i < sz; i++)
+    ASSERT_EQ(read_ul(ifs), static_cast<unsigned long>(i))
+        << "failed at i = " << i;
+}
@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <spsc_queue.hpp>
+#include <string>
+#include <thread>
+#include <write_behind.hpp>
+
+TEST(SpscQueue, keeps_order_between_threads) {
+  ExternalSort::SpscQueue<long> queue(3);
+  const long count = 200'000;
+  std::thread producer([&]() {
+    for (long i = 0; i < count; i++)
+      queue.push(i);
+  });
+  for (long i = 0; i < count; i++) {
+    long value = -1;
+    queue.pop(value);
+    ASSERT_EQ(value, i);
+  }
+  producer.join();
+  long value;
+  ASSERT_FALSE(queue.try_pop(value));
+}
+
+TEST(WriteBehind, writes_and_rewrites_header) {
+  const std::string filename("write_behind.bin");
+  ExternalSort::io_buffer buffer(4 * ExternalSort::write_behind_chunk);
+  const unsigned long sz = 1'000'000;
+  {
+    std::ofstream ofs(filename, std::ios::out | std::ios::binary);
+    ASSERT_TRUE(ExternalSort::attach_write_behind(ofs, buffer));
+    unsigned long value = 0;
+    ofs.write(reinterpret_cast<char *>(&value), sizeof(value));
+    for (value = 0; value < sz; value++)
+      ofs.write(reinterpret_cast<char *>(&value), sizeof(value));
+    auto end = ofs.tellp();
+    ASSERT_EQ(static_cast<unsigned long>(end), (sz + 1) * sizeof(long));
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char *>(&sz), sizeof(sz));
+    ofs.seekp(end);
+    ofs.flush();
+    ASSERT_TRUE(ofs.good());
+  }
+
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  unsigned long value;
+  ifs.read(reinterpret_cast<char *>(&value), sizeof(value));
+  ASSERT_EQ(value, sz);
+  for (unsigned long i = 0; i < sz; i++) {
+    ifs.read(reinterpret_cast<char *>(&value), sizeof(value));
+    ASSERT_EQ(value, i) << "failed at i = " << i;
+  }
+  ifs.read(reinterpret_cast<char *>(&value), sizeof(value));
+  ASSERT_TRUE(ifs.eof());
+}
+
+TEST(WriteBehind, small_buffers_keep_the_filebuf) {
+  ExternalSort::io_buffer buffer(ExternalSort::write_behind_chunk);
+  std::ofstream ofs("write_behind_small.bin", std::ios::out | std::ios::binary);
+  ASSERT_FALSE(ExternalSort::attach_write_behind(ofs, buffer));
+  ASSERT_EQ(ofs.rdbuf(), static_cast<std::ios &>(ofs).rdbuf());
+}